@@ -0,0 +1,20 @@
+// The Lispy Grammar
+//
+// The language read by the interpreter, in mpca_lang's notation. It lives in
+// its own header so that parse_bench.c parses exactly what variables.c does.
+// The rules must be given their parsers in the order they are listed here,
+// which is also the order of the rule ids.
+
+#ifndef grammar_h
+#define grammar_h
+
+#define LISPY_GRAMMAR \
+    "number   : /-?[0-9]+/ ;                                         \n" \
+    "symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                   \n" \
+    "string   : /\"(\\\\.|[^\"])*\"/ ;                               \n" \
+    "sexpr    : '(' <expr>* ')' ;                                    \n" \
+    "qexpr    : '{' <expr>* '}' ;                                    \n" \
+    "expr     : <number> | <symbol> | <string> | <sexpr> | <qexpr> ; \n" \
+    "lispy    : /^/ <expr>* /$/ ;                                    \n"
+
+#endif
@@ -0,0 +1,459 @@
+// Value Tests and Benchmarks
+//
+// Checks and timings for the interpreter's own value code, kept out of the
+// interpreter itself. They need its internals, so this file compiles
+// variables.c into itself, without its main:
+//
+//     cc -std=c99 -O2 lval_bench.c mpc.c -ledit -lm -o lval_bench
+//
+// then run one of
+//
+//     ./lval_bench --reader-equiv=inputs
+//     ./lval_bench --reader-bench=kilobytes
+//     ./lval_bench --serialize-roundtrip=trees
+//     ./lval_bench --serialize-bench=lists
+//     ./lval_bench --sort-bench=numbers
+
+#define LISPY_NO_MAIN
+#include "variables.c"
+
+// Random Source
+//
+// Inputs are generated from a fixed seed, so every run checks the same ones.
+// Besides well formed expressions, the generator can leave out the space
+// between items and add stray or unfinished tokens, which is where the two
+// readers are most likely to disagree.
+
+void gen_whitespace(lbuf* b) {
+    static const char* spaces[] = { " ", " ", "  ", "\n", "\t", "\r\n" };
+    lbuf_puts(b, spaces[rand() % 6]);
+}
+
+void gen_expr(lbuf* b, int depth, int broken) {
+    static const char symbol_chars[] = "abcxyz_+-*/\\=<>!&0123456789";
+    static const char string_chars[] = "ab (){}";
+
+    switch (rand() % (depth > 0 ? 6 : 3)) {
+        case 0: {
+            // Numbers, and in broken input some too long to fit in a long.
+
+            if (rand() % 3 == 0) {
+                lbuf_putc(b, '-');
+            }
+
+            int digits = 1 + rand() % (broken && rand() % 8 == 0 ? 24 : 6);
+
+            for (int i = 0; i < digits; i++) {
+                lbuf_putc(b, '0' + rand() % 10);
+            }
+            break;
+        }
+        case 1: {
+            int length = 1 + rand() % 6;
+
+            for (int i = 0; i < length; i++) {
+                lbuf_putc(b, symbol_chars[rand() % (sizeof(symbol_chars) - 1)]);
+            }
+            break;
+        }
+        case 2: {
+            int length = rand() % 8;
+            lbuf_putc(b, '"');
+
+            for (int i = 0; i < length; i++) {
+                switch (rand() % 6) {
+                    case 0: lbuf_puts(b, "\\\""); break;
+                    case 1: lbuf_puts(b, rand() % 2 ? "\\n" : "\\\\"); break;
+                    case 2: lbuf_putc(b, '\n'); break;
+                    default: lbuf_putc(b, string_chars[rand() % (sizeof(string_chars) - 1)]); break;
+                }
+            }
+
+            // An unfinished string runs to the end of the input.
+
+            if (!broken || rand() % 16 != 0) {
+                lbuf_putc(b, '"');
+            }
+            break;
+        }
+        default: {
+            int sexpr = rand() % 2;
+            int count = rand() % 5;
+            lbuf_putc(b, sexpr ? '(' : '{');
+
+            for (int i = 0; i < count; i++) {
+                if (i > 0 && (!broken || rand() % 8 != 0)) {
+                    gen_whitespace(b);
+                }
+
+                gen_expr(b, depth - 1, broken);
+            }
+
+            if (!broken || rand() % 16 != 0) {
+                lbuf_putc(b, sexpr ? ')' : '}');
+            }
+            break;
+        }
+    }
+
+    if (broken && rand() % 32 == 0) {
+        static const char* strays[] = { ")", "}", "#", "'", "{" };
+        lbuf_puts(b, strays[rand() % 5]);
+    }
+}
+
+// Generate some top level expressions into a new string.
+
+char* gen_source(int exprs, int broken) {
+    lbuf b = { NULL, 0, 0, NULL };
+
+    for (int i = 0; i < exprs; i++) {
+        gen_expr(&b, 4, broken);
+        gen_whitespace(&b);
+    }
+
+    lbuf_putc(&b, '\0');
+    return b.data;
+}
+
+// Reader Equivalence
+//
+// The direct reader must read exactly what the mpc reader does: the same
+// values for any input mpc accepts, and an Error for any input it rejects.
+// The wording of the two errors may differ.
+
+int reader_equiv(int inputs) {
+    int mismatches = 0;
+
+    for (int k = 0; k < inputs; k++) {
+        char* source = gen_source(rand() % 6, 1);
+
+        read_direct = 0;
+        lval* x = lispy_read("<equiv>", source);
+        read_direct = 1;
+        lval* y = lispy_read("<equiv>", source);
+
+        int same = x->type == LVAL_ERR || y->type == LVAL_ERR ?
+            x->type == y->type : lval_eq(x, y);
+
+        if (!same) {
+            if (mismatches < 5) {
+                printf("Readers differ on:\n%s\n", source);
+                printf("mpc: ");
+                lval_println(x);
+                printf("direct: ");
+                lval_println(y);
+            }
+
+            mismatches++;
+        }
+
+        lval_del(x);
+        lval_del(y);
+        free(source);
+    }
+
+    printf("%d of %d inputs read differently.\n", mismatches, inputs);
+    return mismatches == 0;
+}
+
+// Reader Benchmark
+//
+// Times both readers on the same generated source of about the given size.
+
+double reader_time(const char* source, int direct) {
+    read_direct = direct;
+
+    double start = clock_seconds();
+    lval* x = lispy_read("<bench>", source);
+    double seconds = clock_seconds() - start;
+
+    lval_del(x);
+    return seconds;
+}
+
+int reader_bench(int kilobytes) {
+    if (kilobytes < 1) {
+        fprintf(stderr, "--reader-bench needs a size in kilobytes.\n");
+        return 0;
+    }
+
+    lbuf b = { NULL, 0, 0, NULL };
+
+    while (b.length < kilobytes * 1024) {
+        char* part = gen_source(64, 0);
+        lbuf_puts(&b, part);
+        free(part);
+    }
+
+    lbuf_putc(&b, '\0');
+
+    double mb = (b.length - 1) / 1e6;
+    double mpc = reader_time(b.data, 0);
+    double direct = reader_time(b.data, 1);
+
+    printf("%.2f MB of source\n", mb);
+    printf("mpc reader:    %8.2f MB/s\n", mb / mpc);
+    printf("direct reader: %8.2f MB/s (%.1fx)\n", mb / direct, mpc / direct);
+
+    free(b.data);
+    return 1;
+}
+
+// Serialization Round Trip
+//
+// Every random tree must decode to a value lval_eq to the one encoded. The
+// trees hold every type, including Errors and Functions, which source text
+// cannot express. Every truncated copy of an encoding must be rejected, and
+// copies with a bit flipped must decode to something or be rejected, without
+// crashing; run under ASan to check the latter properly.
+
+lval* gen_lval(int depth) {
+    static const char text_chars[] = "ab \n\"\\{}()";
+
+    switch (rand() % (depth > 0 ? 8 : 5)) {
+        case 0: {
+            long x = ((long) rand() << 16) ^ rand();
+            return lval_num(rand() % 2 ? x : rand() % 2 ? -x : LONG_MIN + rand() % 2);
+        }
+        case 1:
+        case 2: {
+            char text[8];
+            int length = rand() % 8;
+
+            for (int i = 0; i < length; i++) {
+                text[i] = text_chars[rand() % (sizeof(text_chars) - 1)];
+            }
+
+            text[length] = '\0';
+
+            // Few distinct symbol names, so the symbol table is shared.
+
+            if (rand() % 3 == 0) {
+                return lval_str(text);
+            }
+
+            if (rand() % 4 == 0) {
+                return lval_err("%s", text);
+            }
+
+            char* names[] = { "x", "+", "def", "a-long-name" };
+            return lval_sym(names[rand() % 4]);
+        }
+        case 3:
+            return lval_fun(lbuiltins[rand() % lbuiltins_num()].func);
+        case 4:
+            return rand() % 2 ? lval_sexpr() : lval_qexpr();
+        default: {
+            lval* x = rand() % 2 ? lval_sexpr() : lval_qexpr();
+            int count = rand() % 6;
+
+            for (int i = 0; i < count; i++) {
+                lval_add(x, gen_lval(depth - 1));
+            }
+
+            return x;
+        }
+    }
+}
+
+int serialize_roundtrip(int trees) {
+    int mismatches = 0;
+    int accepted = 0;
+    long flips = 0;
+
+    for (int k = 0; k < trees; k++) {
+        lval* v = gen_lval(5);
+        lbuf b = { NULL, 0, 0, NULL };
+        lval_serialize(&b, v);
+
+        lval* x = lval_deserialize(b.data, b.length);
+
+        if (!lval_eq(v, x)) {
+            mismatches++;
+        }
+
+        lval_del(x);
+
+        for (int n = 0; n < b.length; n++) {
+            x = lval_deserialize(b.data, n);
+            accepted += x->type != LVAL_ERR;
+            lval_del(x);
+        }
+
+        for (int n = 0; n < 8; n++) {
+            int at = rand() % b.length;
+            char bit = (char) (1 << rand() % 8);
+
+            b.data[at] ^= bit;
+            lval_del(lval_deserialize(b.data, b.length));
+            b.data[at] ^= bit;
+            flips++;
+        }
+
+        free(b.data);
+        lval_del(v);
+    }
+
+    printf("%d of %d trees came back different.\n", mismatches, trees);
+    printf("%d truncated copies were accepted.\n", accepted);
+    printf("%ld copies with a flipped bit were decoded without crashing.\n", flips);
+    return mismatches == 0 && accepted == 0;
+}
+
+// Serialization Benchmark
+//
+// Writes and reads back the same value as text, with the printer and the
+// direct reader, and in the binary format. The value is a Q-Expression of the
+// given number of small lists.
+
+int serialize_bench(int lists) {
+    if (lists < 1) {
+        fprintf(stderr, "--serialize-bench needs a number of lists.\n");
+        return 0;
+    }
+
+    lval* v = lval_qexpr();
+
+    for (int i = 0; i < lists; i++) {
+        char* source = gen_source(1, 0);
+        lval* x = lval_read_direct("<bench>", source);
+        free(source);
+
+        while (x->count > 0) {
+            lval_add(v, lval_pop(x, 0));
+        }
+
+        lval_del(x);
+    }
+
+    lbuf text = { NULL, 0, 0, NULL };
+    double start = clock_seconds();
+    lbuf_put_lval(&text, v);
+    lbuf_putc(&text, '\0');
+    double text_write = clock_seconds() - start;
+
+    start = clock_seconds();
+    lval* x = lval_read_direct("<bench>", text.data);
+    double text_read = clock_seconds() - start;
+    int text_ok = x->type == LVAL_SEXPR && x->count == 1 && lval_eq(v, x->cell[0]);
+    lval_del(x);
+
+    lbuf binary = { NULL, 0, 0, NULL };
+    start = clock_seconds();
+    lval_serialize(&binary, v);
+    double binary_write = clock_seconds() - start;
+
+    start = clock_seconds();
+    x = lval_deserialize(binary.data, binary.length);
+    double binary_read = clock_seconds() - start;
+    int binary_ok = lval_eq(v, x);
+    lval_del(x);
+
+    double text_mb = (text.length - 1) / 1e6;
+    double binary_mb = binary.length / 1e6;
+
+    printf("text:   %6.2f MB, write %7.2f MB/s, read %7.2f MB/s%s\n", text_mb,
+           text_mb / text_write, text_mb / text_read, text_ok ? "" : " (read back wrong)");
+    printf("binary: %6.2f MB, write %7.2f MB/s, read %7.2f MB/s%s\n", binary_mb,
+           binary_mb / binary_write, binary_mb / binary_read, binary_ok ? "" : " (read back wrong)");
+    printf("binary takes %.2fx the time of text to write and %.2fx to read.\n",
+           binary_write / text_write, binary_read / text_read);
+
+    free(text.data);
+    free(binary.data);
+    lval_del(v);
+    return text_ok && binary_ok;
+}
+
+// Sort Benchmark
+//
+// Sorts the same random numbers, positive and negative, with the radix sort
+// that lval_sort uses for a list of Numbers and with the introsort it uses for
+// anything else, and checks both results are in order.
+
+lval* sort_numbers(int n) {
+    lval* v = lval_qexpr();
+
+    for (int i = 0; i < n; i++) {
+        long x = ((long) rand() << 31) ^ ((long) rand() << 8) ^ rand();
+        lval_add(v, lval_num(rand() % 2 ? x : -x));
+    }
+
+    return v;
+}
+
+int sort_sorted(lval* v) {
+    for (int i = 1; i < v->count; i++) {
+        if (lval_cmp(v->cell[i - 1], v->cell[i]) > 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int sort_bench(int n) {
+    if (n < 2) {
+        fprintf(stderr, "--sort-bench needs at least 2 numbers.\n");
+        return 0;
+    }
+
+    unsigned int seed = rand();
+
+    srand(seed);
+    lval* v = sort_numbers(n);
+    double start = clock_seconds();
+    lval_sort(v);
+    double radix = clock_seconds() - start;
+    int ok = sort_sorted(v);
+    lval_del(v);
+
+    srand(seed);
+    v = sort_numbers(n);
+    int depth = 0;
+
+    for (int k = n; k > 1; k >>= 1) {
+        depth += 2;
+    }
+
+    start = clock_seconds();
+    lval_sort_intro(v->cell, 0, v->count, depth);
+    double intro = clock_seconds() - start;
+    ok = ok && sort_sorted(v);
+    lval_del(v);
+
+    printf("%d numbers: radix %.3fs, introsort %.3fs (%.1fx)%s\n", n, radix, intro,
+           intro / radix, ok ? "" : ", NOT SORTED");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int ok = 0;
+    int known = 1;
+
+    srand(1);
+    lispy_grammar_new();
+
+    if (argc == 2 && strncmp(argv[1], "--reader-equiv=", 15) == 0) {
+        ok = reader_equiv(atoi(argv[1] + 15));
+    } else if (argc == 2 && strncmp(argv[1], "--reader-bench=", 15) == 0) {
+        ok = reader_bench(atoi(argv[1] + 15));
+    } else if (argc == 2 && strncmp(argv[1], "--serialize-roundtrip=", 22) == 0) {
+        ok = serialize_roundtrip(atoi(argv[1] + 22));
+    } else if (argc == 2 && strncmp(argv[1], "--serialize-bench=", 18) == 0) {
+        ok = serialize_bench(atoi(argv[1] + 18));
+    } else if (argc == 2 && strncmp(argv[1], "--sort-bench=", 13) == 0) {
+        ok = sort_bench(atoi(argv[1] + 13));
+    } else {
+        fprintf(stderr, "Usage: %s --reader-equiv=inputs\n"
+                "       %s --reader-bench=kilobytes\n"
+                "       %s --serialize-roundtrip=trees\n"
+                "       %s --serialize-bench=lists\n"
+                "       %s --sort-bench=numbers\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+        known = 0;
+    }
+
+    lispy_grammar_delete();
+    return known && ok ? 0 : 1;
+}
@@ -1,3 +1,19 @@
+/*
+** Regular files are mapped into memory on
+** platforms that have mmap, which needs the
+** POSIX declarations on top of C89.
+*/
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MPC_PARSER_INTERNALS
 #include "mpc.h"
 
 /*
@@ -20,6 +36,15 @@ static mpc_state_t mpc_state_new(void) {
   return s;
 }
 
+/* A position whose row and column are filled in later */
+static mpc_state_t mpc_state_at(long pos) {
+  mpc_state_t s;
+  s.pos = pos;
+  s.row = 0;
+  s.col = 0;
+  return s;
+}
+
 static mpc_state_t *mpc_state_copy(mpc_state_t s) {
   mpc_state_t *r = malloc(sizeof(mpc_state_t));
   memcpy(r, &s, sizeof(mpc_state_t));
@@ -70,6 +95,28 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *y = malloc(sizeof(mpc_err_t));
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (i = 0; i < x->expected_num; i++) {
+    y->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(y->expected[i], x->expected[i]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->recieved = x->recieved;
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
   
   int i;
@@ -122,13 +169,13 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
+/*
+** A character is quoted into the caller's buffer,
+** which must have room for four chars, so that errors
+** can be turned into strings on many threads at once.
+*/
 
-static char *mpc_err_char_unescape(char c) {
-  
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
   switch (c) {
     
@@ -142,8 +189,11 @@ static char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[0] = '\'';
+      buffer[1] = c;
+      buffer[2] = '\'';
+      buffer[3] = '\0';
+      return buffer;
   }
   
 }
@@ -151,6 +201,7 @@ static char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
   
   char *buffer = calloc(1, 1024);
+  char quoted[4];
   int max = 1023;
   int pos = 0; 
   int i;
@@ -163,7 +214,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, 
-    "%s:%i:%i: error: expected ", x->filename, x->state.row+1, x->state.col+1);
+    "%s:%li:%li: error: expected ", x->filename, x->state.row+1, x->state.col+1);
   
   if (x->expected_num == 0) { mpc_err_string_cat(buffer, &pos, &max, "ERROR: NOTHING EXPECTED"); }
   if (x->expected_num == 1) { mpc_err_string_cat(buffer, &pos, &max, "%s", x->expected[0]); }
@@ -179,7 +230,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, quoted));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -281,25 +332,35 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** operation: String, File and Pipe.
 **
 ** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** already in a buffer and scanned through.
+** The buffer belongs to the caller and is
+** never copied; its length is known up front
+** so it needs no terminator. The cursor can
+** jump around at will making backtracking easy.
 **
 ** The second is a File which is also somewhat
-** easy. The contents are never loaded into 
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** easy. Where possible a regular file is mapped
+** into memory and then read exactly like a
+** String. Otherwise the contents are never loaded
+** into memory but backtracking can still be
+** achieved by seeking in the file at different
+** positions. A File that cannot be seeked is
+** read as a Pipe.
 **
 ** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and 
-** only support a single character lookahead at 
-** any point, when the input is marked for a 
-** potential backtracking we start buffering any 
-** input.
-**
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** one. As we assume pipes cannot be seeked, the
+** input is read in large blocks into a list of
+** fixed size chunks, and the cursor is an index
+** into them. Backtracking moves the cursor back
+** as for a String. A chunk is recycled for new
+** input once the cursor and every mark have
+** moved past it, so memory use depends on how
+** far the parser may backtrack rather than on
+** the length of the input. A Pipe is read through
+** stdio one character at a time, as it is needed,
+** so a parse never waits for input it does not
+** use, and takes no more of the stream than the
+** characters the parser looked at.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -307,6 +368,11 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 **
 */
 
+enum {
+  MPC_INPUT_CHUNK = 65536,
+  MPC_INPUT_MARKS_MIN = 32
+};
+
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
@@ -317,22 +383,48 @@ typedef struct {
 
   int type;
   char *filename;  
-  mpc_state_t state;
+  long pos;
   
-  char *string;
-  char *buffer;
+  const char *string;
+  long length;
   FILE *file;
   
+  char **chunks;
+  int chunks_num;
+  long chunks_pos;
+  
+  long base;
+  
+  char *mapped;
+  size_t mapped_size;
+  
+  int feeding;
+  int programs;
+  
   int backtrack;
   int marks_num;
-  mpc_state_t* marks;
-  char* lasts;
+  int marks_slots;
+  long *marks;
+  char *lasts;
+  long marks_local[MPC_INPUT_MARKS_MIN];
+  char lasts_local[MPC_INPUT_MARKS_MIN];
+  
+  long *lines;
+  long lines_num;
+  long lines_slots;
+  long lines_indexed;
+  
+  int spans_num;
+  int spans_slots;
+  long *spans;
+  
+  mpc_stats_t stats;
   
   char last;
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string, long length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -340,17 +432,35 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
   
-  i->state = mpc_state_new();
+  i->pos = 0;
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
+  i->string = string;
+  i->length = length;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_pos = 0;
   i->file = NULL;
+  i->base = 0;
+  i->mapped = NULL;
+  i->feeding = 0;
+  i->programs = 1;
   
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = i->marks_local;
+  i->lasts = i->lasts_local;
+  
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
+  
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_indexed = 0;
+  
+  i->spans_num = 0;
+  i->spans_slots = 0;
+  i->spans = NULL;
 
   i->last = '\0';
   
@@ -365,16 +475,35 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   strcpy(i->filename, filename);
   
   i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
+  i->pos = 0;
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_pos = 0;
   i->file = pipe;
+  i->base = 0;
+  i->mapped = NULL;
+  i->feeding = 0;
+  i->programs = 1;
   
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = i->marks_local;
+  i->lasts = i->lasts_local;
+  
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
+  
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_indexed = 0;
+  
+  i->spans_num = 0;
+  i->spans_slots = 0;
+  i->spans = NULL;
   
   i->last = '\0';
   
@@ -382,6 +511,54 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   
 }
 
+/*
+** A File that cannot be seeked, such as a pipe or
+** terminal, is read as a Pipe instead. The rest of
+** a regular file is mapped into memory where
+** possible and read as a String from there.
+** Anything else is left to the File functions.
+** Either way parsing starts from where the File
+** is, which is kept as the base that positions
+** are counted from. A File whose size does not fit
+** a long or a size_t, as on platforms where they
+** are 32 bits, is never mapped.
+*/
+
+static void mpc_input_map(mpc_input_t *i) {
+  
+  long offset = ftell(i->file);
+  
+#ifdef MPC_MMAP
+  struct stat st;
+  void *base;
+#endif
+  
+  if (offset < 0) {
+    i->type = MPC_INPUT_PIPE;
+    return;
+  }
+  
+  i->base = offset;
+  
+#ifdef MPC_MMAP
+  
+  if (fstat(fileno(i->file), &st) != 0) { return; }
+  if (!S_ISREG(st.st_mode) || st.st_size <= offset) { return; }
+  if ((long)st.st_size != st.st_size) { return; }
+  if ((off_t)(size_t)st.st_size != st.st_size) { return; }
+  
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(i->file), 0);
+  if (base == MAP_FAILED) { return; }
+  
+  i->type = MPC_INPUT_STRING;
+  i->mapped = base;
+  i->mapped_size = st.st_size;
+  i->string = i->mapped + offset;
+  i->length = st.st_size - offset;
+  
+#endif
+}
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -389,34 +566,75 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
+  i->pos = 0;
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_pos = 0;
   i->file = file;
+  i->base = 0;
+  i->mapped = NULL;
+  i->feeding = 0;
+  i->programs = 1;
   
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = i->marks_local;
+  i->lasts = i->lasts_local;
+  
+  memset(&i->stats, 0, sizeof(mpc_stats_t));
+  
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_indexed = 0;
+  
+  i->spans_num = 0;
+  i->spans_slots = 0;
+  i->spans = NULL;
   
   i->last = '\0';
   
+  mpc_input_map(i);
+  
   return i;
 }
 
 static void mpc_input_delete(mpc_input_t *i) {
   
+  int j;
+  
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+#ifdef MPC_MMAP
+  /* Leave the file where reading it would have */
+  if (i->mapped) {
+    fseek(i->file, i->base + i->pos, SEEK_SET);
+    munmap(i->mapped, i->mapped_size);
+  }
+#endif
+  
+  for (j = 0; j < i->chunks_num; j++) { free(i->chunks[j]); }
+  free(i->chunks);
   
-  free(i->marks);
-  free(i->lasts);
+  if (i->marks != i->marks_local) {
+    free(i->marks);
+    free(i->lasts);
+  }
+  
+  free(i->lines);
+  free(i->spans);
   free(i);
 }
 
+/* Move a File to a position, counted from its base */
+static void mpc_input_seek(mpc_input_t *i, long pos) {
+  fseek(i->file, i->base + pos, SEEK_SET);
+}
+
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
@@ -424,15 +642,30 @@ static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
+  /*
+  ** The stack only grows, so it is sized by the
+  ** deepest nesting of marks. It starts out in the
+  ** input itself, and only nesting deeper than that
+  ** moves it to the heap.
+  */
+  if (i->marks_num == i->marks_slots && i->marks == i->marks_local) {
+    i->marks_slots *= 2;
+    i->marks = malloc(sizeof(long) * i->marks_slots);
+    i->lasts = malloc(sizeof(char) * i->marks_slots);
+    memcpy(i->marks, i->marks_local, sizeof(long) * i->marks_num);
+    memcpy(i->lasts, i->lasts_local, sizeof(char) * i->marks_num);
+  } else if (i->marks_num == i->marks_slots) {
+    i->marks_slots *= 2;
+    i->marks = realloc(i->marks, sizeof(long) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  }
+  
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-  i->marks[i->marks_num-1] = i->state;
+  i->marks[i->marks_num-1] = i->pos;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
+  i->stats.marks++;
+  if (i->marks_num > i->stats.marks_peak) { i->stats.marks_peak = i->marks_num; }
   
 }
 
@@ -441,42 +674,188 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
-  }
+}
+
+static void mpc_input_jump(mpc_input_t *i, long pos, char last) {
   
+  i->pos = pos;
+  i->last = last;
+  
+  if (i->type == MPC_INPUT_FILE) {
+    mpc_input_seek(i, i->pos);
+  }
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->state = i->marks[i->marks_num-1];
+  i->pos = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
+  i->stats.rewinds++;
   
   if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
+    mpc_input_seek(i, i->pos);
   }
   
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+/*
+** Only the byte offset of the cursor is kept up to
+** date while parsing. The row and column of a
+** position are worked out when they are asked for,
+** from an index of the offsets of the newlines in
+** the input, which is only built as far as it is
+** needed. Pipes and Files index input as it is read,
+** because it may not be there to look at later.
+*/
+
+static void mpc_input_index_text(mpc_input_t *i, const char *text, long offset, long n) {
+  
+  const char *at = text;
+  const char *end = text + n;
+  
+  while ((at = memchr(at, '\n', end - at)) != NULL) {
+    
+    if (i->lines_num == i->lines_slots) {
+      i->lines_slots = i->lines_slots ? i->lines_slots * 2 : MPC_INPUT_MARKS_MIN;
+      i->lines = realloc(i->lines, sizeof(long) * i->lines_slots);
+    }
+    
+    i->lines[i->lines_num++] = offset + (at - text);
+    at++;
+  }
+}
+
+static mpc_state_t mpc_input_state(mpc_input_t *i, long pos) {
+  
+  mpc_state_t s;
+  long lo = 0, hi, mid;
+  
+  if (i->type == MPC_INPUT_STRING && pos > i->lines_indexed) {
+    mpc_input_index_text(i, i->string + i->lines_indexed, i->lines_indexed, pos - i->lines_indexed);
+    i->lines_indexed = pos;
+  }
+  
+  /* Count the newlines before pos */
+  hi = i->lines_num;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (i->lines[mid] < pos) { lo = mid + 1; } else { hi = mid; }
+  }
+  
+  s.pos = pos;
+  s.row = lo;
+  s.col = lo > 0 ? pos - i->lines[lo-1] - 1 : pos;
+  return s;
+}
+
+/*
+** Find room for the next block of a Pipe. Chunks
+** before the cursor, the earliest mark and the start
+** of the outermost span are no longer needed, so the
+** first of them is reused for the new block when it
+** can be. Returns how much fits in the space given.
+*/
+
+static long mpc_input_pipe_space(mpc_input_t *i, char **text) {
+  
+  long used = i->length - i->chunks_pos;
+  long needed = i->marks_num > 0 ? i->marks[0] : i->pos;
+  char *chunk;
+  
+  if (i->spans_num > 0 && i->spans[0] < needed) { needed = i->spans[0]; }
+  
+  if (used == i->chunks_num * MPC_INPUT_CHUNK) {
+    
+    if (i->chunks_num > 0 && i->chunks_pos + MPC_INPUT_CHUNK <= needed) {
+      chunk = i->chunks[0];
+      memmove(i->chunks, i->chunks + 1, sizeof(char*) * (i->chunks_num - 1));
+      i->chunks_pos += MPC_INPUT_CHUNK;
+      used -= MPC_INPUT_CHUNK;
+    } else {
+      chunk = malloc(MPC_INPUT_CHUNK);
+      i->chunks_num++;
+      i->chunks = realloc(i->chunks, sizeof(char*) * i->chunks_num);
+    }
+    
+    i->chunks[i->chunks_num-1] = chunk;
+  }
+  
+  *text = i->chunks[i->chunks_num-1] + used % MPC_INPUT_CHUNK;
+  return MPC_INPUT_CHUNK - used % MPC_INPUT_CHUNK;
+}
+
+static void mpc_input_pipe_add(mpc_input_t *i, const char *text, long n) {
+  /* Index each block as it arrives, before its chunk can be reused */
+  mpc_input_index_text(i, text, i->length, n);
+  i->length += n;
+  i->lines_indexed = i->length;
+}
+
+/*
+** Read the next character of a Pipe, returning 0 at
+** the end of the input. Input that is pushed rather
+** than read has no File, and is only added by feeding
+** it.
+**
+** Only one character is taken per call. Reading any
+** more could wait on a terminal or socket for input
+** the parse does not need, and stdio gives no way to
+** ask how much is already there. stdio still buffers
+** the reads underneath, so this is no slower than a
+** getc. Callers that want to hand over input in
+** blocks as it arrives can push it to a session.
+*/
+
+static int mpc_input_pipe_fill(mpc_input_t *i) {
+  
+  char *text;
+  int c;
+  
+  if (i->file == NULL) { return 0; }
+  
+  c = getc(i->file);
+  if (c == EOF) { return 0; }
+  
+  mpc_input_pipe_space(i, &text);
+  text[0] = (char)c;
+  mpc_input_pipe_add(i, text, 1);
+  
+  return 1;
+}
+
+static void mpc_input_pipe_feed(mpc_input_t *i, const char *data, long length) {
+  
+  char *text;
+  long n;
+  
+  while (length > 0) {
+    n = mpc_input_pipe_space(i, &text);
+    if (n > length) { n = length; }
+    memcpy(text, data, n);
+    mpc_input_pipe_add(i, text, n);
+    data += n;
+    length -= n;
+  }
 }
 
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+static char mpc_input_pipe_get(mpc_input_t *i) {
+  
+  long offset;
+  
+  if (i->pos >= i->length && !mpc_input_pipe_fill(i)) { return '\0'; }
+  
+  offset = i->pos - i->chunks_pos;
+  return i->chunks[offset / MPC_INPUT_CHUNK][offset % MPC_INPUT_CHUNK];
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->pos >= i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && i->pos >= i->length) { return 1; }
   return 0;
 }
 
@@ -486,20 +865,21 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
-    
-      if (!i->buffer) { c = getc(i->file); return c; }
+    case MPC_INPUT_STRING:
+      return i->pos < i->length ? i->string[i->pos] : '\0';
+    case MPC_INPUT_FILE:
       
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
+      c = fgetc(i->file);
+      
+      /* A File is indexed as it is first read */
+      if (i->pos == i->lines_indexed && !feof(i->file)) {
+        mpc_input_index_text(i, &c, i->pos, 1);
+        i->lines_indexed++;
       }
+      
+      return c;
     
+    case MPC_INPUT_PIPE: return mpc_input_pipe_get(i);
     default: return c;
   }
 }
@@ -509,7 +889,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return i->pos < i->length ? i->string[i->pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -518,24 +899,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
       fseek(i->file, -1, SEEK_CUR);
       return c;
     
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-    
+    case MPC_INPUT_PIPE: return mpc_input_pipe_get(i);
     default: return c;
   }
   
@@ -546,16 +910,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: break;
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
-    case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
-      
+    case MPC_INPUT_PIPE: break;
   }
   
   return 0;
@@ -563,25 +918,13 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
-  if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
-      !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-  
   i->last = c;
-  i->state.pos++;
-  i->state.col++;
+  i->pos++;
   
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
-  }
-  
-  if (o) {
+  /* Inside a span no values are built */
+  if (o && i->spans_num > 0) {
+    (*o) = NULL;
+  } else if (o) {
     (*o) = malloc(2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -643,8 +986,12 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (i->spans_num > 0) {
+    *o = NULL;
+  } else {
+    *o = malloc(strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -653,90 +1000,133 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char)) {
 }
 
 /*
-** Parser Type
+** While input is still being fed, a step that would
+** look past the end of what has arrived so far must
+** wait for more rather than treat it as the end of
+** the input. This is how far each step may look.
 */
 
-enum {
-  MPC_TYPE_UNDEFINED = 0,
-  MPC_TYPE_PASS      = 1,
-  MPC_TYPE_FAIL      = 2,
-  MPC_TYPE_LIFT      = 3,
-  MPC_TYPE_LIFT_VAL  = 4,
-  MPC_TYPE_EXPECT    = 5,
-  MPC_TYPE_ANCHOR    = 6,
-  MPC_TYPE_STATE     = 7,
-  
-  MPC_TYPE_ANY       = 8,
-  MPC_TYPE_SINGLE    = 9,
-  MPC_TYPE_ONEOF     = 10,
-  MPC_TYPE_NONEOF    = 11,
-  MPC_TYPE_RANGE     = 12,
-  MPC_TYPE_SATISFY   = 13,
-  MPC_TYPE_STRING    = 14,
-  
-  MPC_TYPE_APPLY     = 15,
-  MPC_TYPE_APPLY_TO  = 16,
-  MPC_TYPE_PREDICT   = 17,
-  MPC_TYPE_NOT       = 18,
-  MPC_TYPE_MAYBE     = 19,
-  MPC_TYPE_MANY      = 20,
-  MPC_TYPE_MANY1     = 21,
-  MPC_TYPE_COUNT     = 22,
-  
-  MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
-};
+static int mpc_input_starved(mpc_input_t *i, const mpc_parser_t *p, int st) {
+  
+  long need = 0;
+  
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_ANCHOR:
+      need = 1;
+      break;
+    case MPC_TYPE_STRING:
+      need = strlen(p->data.string.x);
+      break;
+    /* These peek at the next character when reporting an error */
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_NOT:
+      need = st == 1 ? 1 : 0;
+      break;
+  }
+  
+  return i->pos + need > i->length;
+}
 
-typedef struct { char *m; } mpc_pdata_fail_t;
-typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
-typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
-typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
-typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
-typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
-typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
-typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
-typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
-typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
-
-typedef union {
-  mpc_pdata_fail_t fail;
-  mpc_pdata_lift_t lift;
-  mpc_pdata_expect_t expect;
-  mpc_pdata_anchor_t anchor;
-  mpc_pdata_single_t single;
-  mpc_pdata_range_t range;
-  mpc_pdata_satisfy_t satisfy;
-  mpc_pdata_string_t string;
-  mpc_pdata_apply_t apply;
-  mpc_pdata_apply_to_t apply_to;
-  mpc_pdata_predict_t predict;
-  mpc_pdata_not_t not;
-  mpc_pdata_repeat_t repeat;
-  mpc_pdata_and_t and;
-  mpc_pdata_or_t or;
-} mpc_pdata_t;
-
-struct mpc_parser_t {
-  char retained;
-  char *name;
-  char type;
-  mpc_pdata_t data;
-};
+/*
+** While a span is open only the offset it started at
+** is kept. The text it covers is copied out of the
+** input in one go once the outermost span closes.
+*/
+
+static void mpc_input_span_open(mpc_input_t *i) {
+  
+  if (i->spans_num == i->spans_slots) {
+    i->spans_slots = i->spans_slots ? i->spans_slots * 2 : MPC_INPUT_MARKS_MIN;
+    i->spans = realloc(i->spans, sizeof(long) * i->spans_slots);
+  }
+  
+  i->spans[i->spans_num++] = i->pos;
+}
+
+static char *mpc_input_span_close(mpc_input_t *i) {
+  
+  long start = i->spans[--i->spans_num];
+  long n = i->pos - start;
+  long j, k, offset;
+  char *x;
+  
+  if (i->spans_num > 0) { return NULL; }
+  
+  x = malloc(n + 1);
+  
+  switch (i->type) {
+    
+    case MPC_INPUT_STRING:
+      memcpy(x, i->string + start, n);
+      break;
+    
+    case MPC_INPUT_FILE:
+      mpc_input_seek(i, start);
+      n = fread(x, 1, n, i->file);
+      mpc_input_seek(i, i->pos);
+      break;
+    
+    case MPC_INPUT_PIPE:
+      for (j = 0; j < n; j += k) {
+        offset = start + j - i->chunks_pos;
+        k = MPC_INPUT_CHUNK - offset % MPC_INPUT_CHUNK;
+        if (k > n - j) { k = n - j; }
+        memcpy(x + j, i->chunks[offset / MPC_INPUT_CHUNK] + offset % MPC_INPUT_CHUNK, k);
+      }
+      break;
+  }
+  
+  x[n] = '\0';
+  return x;
+}
 
 /*
 ** Stack Type
 */
 
+/*
+** The result a memoised parser gave at one position,
+** where the input was left afterwards, and a copy of
+** the errors it merged in along the way so a later
+** hit can merge them in again.
+*/
+
+typedef struct {
+  const mpc_parser_t *p;
+  long pos;
+  long end;
+  char last;
+  int ok;
+  mpc_result_t r;
+  mpc_err_t *errs;
+} mpc_memo_t;
+
+/* A memoised parser still running, and the errors merged in before it */
+typedef struct {
+  long pos;
+  mpc_err_t *err;
+} mpc_memo_open_t;
+
+/* A span matched by its program, and the errors merged in before it */
+typedef struct {
+  mpc_err_t *err;
+  const mpc_parser_t *p;
+  long pos;
+  long far;
+  char last;
+} mpc_defer_t;
+
 typedef struct {
 
   int parsers_num;
   int parsers_slots;
-  mpc_parser_t **parsers;
+  const mpc_parser_t **parsers;
   int *states;
 
   int results_num;
@@ -746,6 +1136,18 @@ typedef struct {
   
   mpc_err_t *err;
   
+  long memos_num;
+  long memos_slots;
+  mpc_memo_t *memos;
+  
+  int opens_num;
+  int opens_slots;
+  mpc_memo_open_t *opens;
+  
+  int defers_num;
+  int defers_slots;
+  mpc_defer_t *defers;
+  
 } mpc_stack_t;
 
 static mpc_stack_t *mpc_stack_new(const char *filename) {
@@ -763,6 +1165,18 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   
   s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
   
+  s->memos_num = 0;
+  s->memos_slots = 0;
+  s->memos = NULL;
+  
+  s->opens_num = 0;
+  s->opens_slots = 0;
+  s->opens = NULL;
+  
+  s->defers_num = 0;
+  s->defers_slots = 0;
+  s->defers = NULL;
+  
   return s;
 }
 
@@ -773,6 +1187,31 @@ static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
   s->err = mpc_err_or(errs, 2);
 }
 
+/* Frees everything but the errors, which belong to the caller */
+static void mpc_stack_delete(mpc_stack_t *s) {
+  
+  long j;
+  
+  for (j = 0; j < s->memos_slots; j++) {
+    if (s->memos[j].p == NULL) { continue; }
+    if (s->memos[j].ok) {
+      s->memos[j].p->data.memo.dx(s->memos[j].r.output);
+    } else {
+      mpc_err_delete(s->memos[j].r.error);
+    }
+    mpc_err_delete(s->memos[j].errs);
+  }
+  
+  free(s->memos);
+  free(s->opens);
+  free(s->defers);
+  free(s->parsers);
+  free(s->states);
+  free(s->results);
+  free(s->returns);
+  free(s);
+}
+
 static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
   int success = s->returns[0];
   
@@ -784,11 +1223,7 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
     r->error = s->err;
   }
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  mpc_stack_delete(s);
   
   return success;
 }
@@ -815,21 +1250,21 @@ static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
   }
 }
 
-static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
+static void mpc_stack_pushp(mpc_stack_t *s, const mpc_parser_t *p) {
   s->parsers_num++;
   mpc_stack_parsers_reserve_more(s);
   s->parsers[s->parsers_num-1] = p;
   s->states[s->parsers_num-1] = 0;
 }
 
-static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+static void mpc_stack_popp(mpc_stack_t *s, const mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
   mpc_stack_parsers_reserve_less(s);
 }
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+static void mpc_stack_peepp(mpc_stack_t *s, const mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
 }
@@ -889,22 +1324,113 @@ static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
   return s->returns[s->results_num-1];
 }
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    mpc_stack_err(s, x.error);
-    n--;
-  }
+static void mpc_stack_setr_out(mpc_stack_t *s, mpc_val_t *x) {
+  s->results[s->results_num-1] = mpc_result_out(x);
 }
 
-static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
-    n--;
-  }
+/* Stack Memo Stuff */
+
+static unsigned long mpc_memo_hash(const mpc_parser_t *p, long pos) {
+  return (((unsigned long)(size_t)p >> 4) * 31 + (unsigned long)pos) * 2654435761UL;
+}
+
+static mpc_memo_t *mpc_stack_memo_find(mpc_stack_t *s, const mpc_parser_t *p, long pos) {
+  
+  unsigned long j, mask = s->memos_slots - 1;
+  
+  if (s->memos_slots == 0) { return NULL; }
+  
+  for (j = mpc_memo_hash(p, pos) & mask; s->memos[j].p; j = (j+1) & mask) {
+    if (s->memos[j].p == p && s->memos[j].pos == pos) { return &s->memos[j]; }
+  }
+  
+  return NULL;
+}
+
+static void mpc_stack_memos_insert(mpc_memo_t *memos, long slots, mpc_memo_t m) {
+  unsigned long j, mask = slots - 1;
+  for (j = mpc_memo_hash(m.p, m.pos) & mask; memos[j].p; j = (j+1) & mask);
+  memos[j] = m;
+}
+
+static void mpc_stack_memos_reserve_more(mpc_stack_t *s) {
+  
+  long j, slots;
+  mpc_memo_t *memos;
+  
+  if (s->memos_num * 2 <= s->memos_slots) { return; }
+  
+  slots = s->memos_slots ? s->memos_slots * 2 : 64;
+  memos = calloc(slots, sizeof(mpc_memo_t));
+  
+  for (j = 0; j < s->memos_slots; j++) {
+    if (s->memos[j].p) { mpc_stack_memos_insert(memos, slots, s->memos[j]); }
+  }
+  
+  free(s->memos);
+  s->memos = memos;
+  s->memos_slots = slots;
+}
+
+/*
+** While a memoised parser runs the errors merged in
+** are gathered apart from the rest, so they can be
+** remembered along with its result.
+*/
+
+static void mpc_stack_memo_open(mpc_stack_t *s, long pos) {
+  
+  s->opens_num++;
+  if (s->opens_num > s->opens_slots) {
+    s->opens_slots = s->opens_slots * 2 + 8;
+    s->opens = realloc(s->opens, sizeof(mpc_memo_open_t) * s->opens_slots);
+  }
+  
+  s->opens[s->opens_num-1].pos = pos;
+  s->opens[s->opens_num-1].err = s->err;
+  s->err = mpc_err_fail(s->err->filename, mpc_state_invalid(), "Unknown Error");
+}
+
+static void mpc_stack_memo_close(mpc_stack_t *s, const mpc_parser_t *p, long end, char last) {
+  
+  mpc_memo_t m;
+  mpc_result_t r;
+  mpc_err_t *errs = s->err;
+  
+  s->opens_num--;
+  s->err = s->opens[s->opens_num].err;
+  
+  m.p = p;
+  m.pos = s->opens[s->opens_num].pos;
+  m.end = end;
+  m.last = last;
+  m.ok = mpc_stack_peekr(s, &r);
+  m.r = m.ok ? mpc_result_out(p->data.memo.copy(r.output)) : mpc_result_err(mpc_err_copy(r.error));
+  m.errs = mpc_err_copy(errs);
+  
+  s->memos_num++;
+  mpc_stack_memos_reserve_more(s);
+  mpc_stack_memos_insert(s->memos, s->memos_slots, m);
+  
+  mpc_stack_err(s, errs);
+}
+
+static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    mpc_stack_err(s, x.error);
+    n--;
+  }
+}
+
+static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
+  mpc_result_t x;
+  while (n) {
+    mpc_stack_popr(s, &x);
+    ds[n-1](x.output);
+    n--;
+  }
 }
 
 static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
@@ -930,12 +1456,469 @@ static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
   return x;
 }
 
+/*
+** Inside a span every value is NULL, so there is
+** nothing to fold or destruct. The results are just
+** dropped.
+*/
+
+static mpc_val_t *mpc_stack_merger_span(mpc_stack_t *s, mpc_input_t *i, int n, mpc_fold_t f) {
+  if (i->spans_num > 0) { mpc_stack_popr_n(s, n); return NULL; }
+  return mpc_stack_merger_out(s, n, f);
+}
+
 static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
   mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
   mpc_stack_popr_n(s, n);
   return x;
 }
 
+/* Stack Defer Stuff */
+
+/*
+** A span matched by its program merges in none of
+** the errors its body would have along the way.
+** They can only matter if the parse fails with an
+** error as far along as they are, so the span is
+** noted down in their place, and put back at the
+** end if need be. Notes of spans some error has
+** since gone past are dropped as new ones are made.
+*/
+
+static void mpc_stack_defer(mpc_stack_t *s, const mpc_parser_t *p, long pos, char last, long far) {
+  
+  int j, k;
+  long furthest = s->err->state.pos;
+  mpc_err_t *errs[2];
+  
+  for (j = 0; j < s->defers_num; j++) {
+    if (s->defers[j].err->state.pos > furthest) { furthest = s->defers[j].err->state.pos; }
+  }
+  
+  for (j = 0, k = 0; j < s->defers_num; j++) {
+    
+    if (s->defers[j].far >= furthest) { s->defers[k++] = s->defers[j]; continue; }
+    
+    /* Join up the errors either side of it */
+    errs[0] = s->defers[j].err;
+    if (j+1 < s->defers_num) {
+      errs[1] = s->defers[j+1].err;
+      s->defers[j+1].err = mpc_err_or(errs, 2);
+    } else {
+      errs[1] = s->err;
+      s->err = mpc_err_or(errs, 2);
+    }
+  }
+  
+  s->defers_num = k;
+  
+  if (s->defers_num == s->defers_slots) {
+    s->defers_slots = s->defers_slots * 2 + 8;
+    s->defers = realloc(s->defers, sizeof(mpc_defer_t) * s->defers_slots);
+  }
+  
+  s->defers[s->defers_num].err = s->err;
+  s->defers[s->defers_num].p = p;
+  s->defers[s->defers_num].pos = pos;
+  s->defers[s->defers_num].far = far;
+  s->defers[s->defers_num].last = last;
+  s->defers_num++;
+  
+  s->err = mpc_err_fail(s->err->filename, mpc_state_invalid(), "Unknown Error");
+}
+
+/*
+** Span Programs
+*/
+
+/*
+** A span only needs to know where its body stops
+** matching. So when a span is built, a body made
+** only of parsers that do nothing but match is
+** compiled to a flat program for a backtracking
+** machine, which is run by a single loop over the
+** input with no parsers or results to push and pop.
+** A body with anything else in it, or with choices
+** nested too deeply, is left to the parsing loop.
+*/
+
+enum {
+  MPC_PROG_DEPTH = 32
+};
+
+typedef struct {
+  int num;
+  int slots;
+  int depth;
+  mpc_inst_t *code;
+} mpc_prog_t;
+
+static int mpc_prog_emit(mpc_prog_t *g, int op, int x) {
+  
+  if (g->num == g->slots) {
+    g->slots = g->slots ? g->slots * 2 : 16;
+    g->code = realloc(g->code, sizeof(mpc_inst_t) * g->slots);
+  }
+  
+  g->code[g->num].op = op;
+  g->code[g->num].x = x;
+  g->code[g->num].data.s = NULL;
+  return g->num++;
+}
+
+static void mpc_prog_delete(mpc_inst_t *prog) {
+  
+  mpc_inst_t *in;
+  
+  for (in = prog; in->op != MPC_OP_END; in++) {
+    if (in->op == MPC_OP_SET || in->op == MPC_OP_SPAN) { free(in->data.set); }
+  }
+  
+  free(prog);
+}
+
+/* Characters are tested exactly as the input functions test them */
+static void mpc_prog_set_add(unsigned char *set, const mpc_parser_t *p) {
+  
+  int c;
+  char x;
+  
+  for (c = 0; c < 256; c++) {
+    x = (char)c;
+    if ((p->type == MPC_TYPE_ANY)
+    ||  (p->type == MPC_TYPE_SINGLE && x == p->data.single.x)
+    ||  (p->type == MPC_TYPE_RANGE  && x >= p->data.range.x && x <= p->data.range.y)
+    ||  (p->type == MPC_TYPE_ONEOF  && strchr(p->data.string.x, x) != 0)
+    ||  (p->type == MPC_TYPE_NONEOF && strchr(p->data.string.x, x) == 0)) {
+      set[c / 8] |= 1 << (c % 8);
+    }
+  }
+}
+
+/* Whether a parser always matches exactly one character, and which ones */
+static int mpc_prog_single(const mpc_parser_t *p, unsigned char *set) {
+  
+  int j;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      mpc_prog_set_add(set, p);
+      return 1;
+    
+    case MPC_TYPE_EXPECT:   return mpc_prog_single(p->data.expect.x, set);
+    case MPC_TYPE_APPLY:    return mpc_prog_single(p->data.apply.x, set);
+    case MPC_TYPE_APPLY_TO: return mpc_prog_single(p->data.apply_to.x, set);
+    case MPC_TYPE_SPAN:     return mpc_prog_single(p->data.span.x, set);
+    case MPC_TYPE_AND:      return p->data.and.n == 1 && mpc_prog_single(p->data.and.xs[0], set);
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_prog_single(p->data.or.xs[j], set)) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+}
+
+static int mpc_prog_compile(mpc_prog_t *g, const mpc_parser_t *p, int depth);
+
+/* Repeats become a choice around a loop, or a single instruction for sets */
+static int mpc_prog_many(mpc_prog_t *g, const mpc_parser_t *x, int depth) {
+  
+  int at, loop;
+  unsigned char *set = calloc(32, 1);
+  
+  if (mpc_prog_single(x, set)) {
+    at = mpc_prog_emit(g, MPC_OP_SPAN, 0);
+    g->code[at].data.set = set;
+    return 1;
+  }
+  
+  free(set);
+  
+  at = mpc_prog_emit(g, MPC_OP_CHOICE, 0);
+  loop = g->num;
+  if (!mpc_prog_compile(g, x, depth+1)) { return 0; }
+  mpc_prog_emit(g, MPC_OP_PARTIAL_COMMIT, loop);
+  g->code[at].x = g->num;
+  return 1;
+}
+
+static int mpc_prog_compile(mpc_prog_t *g, const mpc_parser_t *p, int depth) {
+  
+  int j, at, commits;
+  unsigned char *set;
+  
+  /* A retained parser may be redefined later, or be part of a loop */
+  if (p->retained) { return 0; }
+  if (depth > g->depth) { g->depth = depth; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+      return 1;
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_FAIL:
+      mpc_prog_emit(g, MPC_OP_FAIL, 0);
+      return 1;
+    
+    case MPC_TYPE_ANY:
+      mpc_prog_emit(g, MPC_OP_ANY, 0);
+      return 1;
+    
+    case MPC_TYPE_SINGLE:
+      mpc_prog_emit(g, MPC_OP_CHAR, p->data.single.x);
+      return 1;
+    
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      at = mpc_prog_emit(g, MPC_OP_SET, 0);
+      g->code[at].data.set = calloc(32, 1);
+      mpc_prog_set_add(g->code[at].data.set, p);
+      return 1;
+    
+    case MPC_TYPE_STRING:
+      at = mpc_prog_emit(g, MPC_OP_STRING, strlen(p->data.string.x));
+      g->code[at].data.s = p->data.string.x;
+      return 1;
+    
+    case MPC_TYPE_SATISFY:
+      at = mpc_prog_emit(g, MPC_OP_SATISFY, 0);
+      g->code[at].data.satisfy = p->data.satisfy.f;
+      return 1;
+    
+    case MPC_TYPE_ANCHOR:
+      at = mpc_prog_emit(g, MPC_OP_ANCHOR, 0);
+      g->code[at].data.anchor = p->data.anchor.f;
+      return 1;
+    
+    case MPC_TYPE_EXPECT:   return mpc_prog_compile(g, p->data.expect.x, depth);
+    case MPC_TYPE_APPLY:    return mpc_prog_compile(g, p->data.apply.x, depth);
+    case MPC_TYPE_APPLY_TO: return mpc_prog_compile(g, p->data.apply_to.x, depth);
+    case MPC_TYPE_SPAN:     return mpc_prog_compile(g, p->data.span.x, depth);
+    
+    case MPC_TYPE_NOT:
+      at = mpc_prog_emit(g, MPC_OP_CHOICE, 0);
+      if (!mpc_prog_compile(g, p->data.not.x, depth+1)) { return 0; }
+      mpc_prog_emit(g, MPC_OP_FAIL_TWICE, 0);
+      g->code[at].x = g->num;
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      at = mpc_prog_emit(g, MPC_OP_CHOICE, 0);
+      if (!mpc_prog_compile(g, p->data.not.x, depth+1)) { return 0; }
+      mpc_prog_emit(g, MPC_OP_COMMIT, g->num + 1);
+      g->code[at].x = g->num;
+      return 1;
+    
+    case MPC_TYPE_MANY:      return mpc_prog_many(g, p->data.repeat.x, depth);
+    case MPC_TYPE_MANY_ACC:  return mpc_prog_many(g, p->data.acc.x, depth);
+    
+    case MPC_TYPE_MANY1:
+      return mpc_prog_compile(g, p->data.repeat.x, depth)
+          && mpc_prog_many(g, p->data.repeat.x, depth);
+    
+    case MPC_TYPE_MANY1_ACC:
+      return mpc_prog_compile(g, p->data.acc.x, depth)
+          && mpc_prog_many(g, p->data.acc.x, depth);
+    
+    case MPC_TYPE_OR:
+      
+      set = calloc(32, 1);
+      if (mpc_prog_single(p, set)) {
+        at = mpc_prog_emit(g, MPC_OP_SET, 0);
+        g->code[at].data.set = set;
+        return 1;
+      }
+      free(set);
+      
+      /* Until they are known the commits to the end are chained through `x` */
+      commits = -1;
+      for (j = 0; j < p->data.or.n-1; j++) {
+        at = mpc_prog_emit(g, MPC_OP_CHOICE, 0);
+        if (!mpc_prog_compile(g, p->data.or.xs[j], depth+1)) { return 0; }
+        commits = mpc_prog_emit(g, MPC_OP_COMMIT, commits);
+        g->code[at].x = g->num;
+      }
+      
+      if (p->data.or.n > 0 && !mpc_prog_compile(g, p->data.or.xs[p->data.or.n-1], depth)) { return 0; }
+      
+      while (commits >= 0) {
+        at = g->code[commits].x;
+        g->code[commits].x = g->num;
+        commits = at;
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_prog_compile(g, p->data.and.xs[j], depth)) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+}
+
+static mpc_inst_t *mpc_prog_new(const mpc_parser_t *p) {
+  
+  mpc_prog_t g;
+  int ok;
+  
+  g.num = 0;
+  g.slots = 0;
+  g.depth = 0;
+  g.code = NULL;
+  
+  ok = mpc_prog_compile(&g, p, 0) && g.depth <= MPC_PROG_DEPTH;
+  mpc_prog_emit(&g, MPC_OP_END, 0);
+  
+  if (!ok) {
+    mpc_prog_delete(g.code);
+    return NULL;
+  }
+  
+  return realloc(g.code, sizeof(mpc_inst_t) * g.num);
+}
+
+/*
+** Programs only read Strings, which they can look
+** at directly. They also need backtracking to be on,
+** and no memoised parser running, as those would
+** want the errors merged in straight away.
+*/
+
+static int mpc_prog_ready(mpc_input_t *i, mpc_stack_t *s) {
+  return i->type == MPC_INPUT_STRING
+    && i->programs
+    && i->backtrack > 0
+    && i->spans_num == 0
+    && s->opens_num == 0;
+}
+
+typedef struct {
+  int at;
+  long pos;
+  char last;
+} mpc_prog_frame_t;
+
+#define MPC_PROG_IN(set, c) ((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+/*
+** Runs a program from the cursor, moving it past
+** the match if there is one. `far` is set to the
+** furthest the cursor got, which is as far as any
+** error the parsing loop would have made could be.
+*/
+
+static int mpc_prog_run(const mpc_inst_t *prog, mpc_input_t *i, long *far) {
+  
+  const char *text = i->string;
+  long length = i->length;
+  long pos = i->pos;
+  char last = i->last;
+  const mpc_inst_t *in = prog;
+  int frames_num = 0;
+  mpc_prog_frame_t frames[MPC_PROG_DEPTH];
+  
+  *far = pos;
+  
+  while (1) {
+    
+    switch (in->op) {
+      
+      case MPC_OP_END:
+        if (pos > *far) { *far = pos; }
+        i->pos = pos;
+        i->last = last;
+        return 1;
+      
+      case MPC_OP_ANY:
+        if (pos < length) { last = text[pos++]; in++; continue; }
+        break;
+      
+      case MPC_OP_CHAR:
+        if (pos < length && text[pos] == (char)in->x) { last = text[pos++]; in++; continue; }
+        break;
+      
+      case MPC_OP_SET:
+        if (pos < length && MPC_PROG_IN(in->data.set, text[pos])) { last = text[pos++]; in++; continue; }
+        break;
+      
+      case MPC_OP_SPAN:
+        while (pos < length && MPC_PROG_IN(in->data.set, text[pos])) { last = text[pos++]; }
+        in++;
+        continue;
+      
+      case MPC_OP_STRING:
+        if (pos + in->x <= length && memcmp(text + pos, in->data.s, in->x) == 0) {
+          pos += in->x;
+          if (in->x > 0) { last = text[pos-1]; }
+          in++;
+          continue;
+        }
+        break;
+      
+      case MPC_OP_SATISFY:
+        if (pos < length && in->data.satisfy(text[pos])) { last = text[pos++]; in++; continue; }
+        break;
+      
+      case MPC_OP_ANCHOR:
+        if (in->data.anchor(last, pos < length ? text[pos] : '\0')) { in++; continue; }
+        break;
+      
+      case MPC_OP_CHOICE:
+        frames[frames_num].at = in->x;
+        frames[frames_num].pos = pos;
+        frames[frames_num].last = last;
+        frames_num++;
+        in++;
+        continue;
+      
+      case MPC_OP_COMMIT:
+        frames_num--;
+        in = prog + in->x;
+        continue;
+      
+      case MPC_OP_PARTIAL_COMMIT:
+        frames[frames_num-1].pos = pos;
+        frames[frames_num-1].last = last;
+        in = prog + in->x;
+        continue;
+      
+      case MPC_OP_FAIL_TWICE:
+        frames_num--;
+        break;
+      
+      default: break;
+    }
+    
+    /* Go back to the last choice, or give up if there is none */
+    if (pos > *far) { *far = pos; }
+    if (frames_num == 0) { return 0; }
+    frames_num--;
+    in = prog + frames[frames_num].at;
+    pos = frames[frames_num].pos;
+    last = frames[frames_num].last;
+  }
+}
+
+#undef MPC_PROG_IN
+
 /*
 ** This is rather pleasant. The core parsing routine
 ** is written in about 200 lines of C.
@@ -960,26 +1943,36 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
 #define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
 #define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, mpc_state_at(i->pos), "Incorrect Input")); }
+#define MPC_SPANNING (i->spans_num > 0)
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+/*
+** Runs until the stack is empty and returns 1, or
+** until input being fed runs out and returns 0. All
+** the state of the parse is kept on the stack, so it
+** can be called again to carry on once more arrives.
+*/
+
+static int mpc_parse_run(mpc_input_t *i, mpc_stack_t *stk) {
   
   /* Stack */
   int st = 0;
-  mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  const mpc_parser_t *p = NULL;
   
   /* Variables */
   char *s;
-  mpc_result_t r;
+  mpc_result_t r, a;
+  mpc_memo_t *m;
+  long far;
+  char last;
 
   /* Go! */
-  mpc_stack_pushp(stk, init);
-  
   while (!mpc_stack_empty(stk)) {
     
     mpc_stack_peepp(stk, &p, &st);
     
+    if (i->feeding && mpc_input_starved(i, p, st)) { return 0; }
+    
     switch (p->type) {
       
       /* Basic Parsers */
@@ -994,18 +1987,18 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       /* Other parsers */
       
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, mpc_state_at(i->pos), "Parser Undefined!"));      
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-      case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, mpc_state_at(i->pos), p->data.fail.m));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.lift.lf());
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.lift.x);
+      case MPC_TYPE_STATE:     MPC_SUCCESS(MPC_SPANNING ? NULL : mpc_state_copy(mpc_input_state(i, i->pos)));
       
       case MPC_TYPE_ANCHOR:
         if (mpc_input_anchor(i, p->data.anchor.f)) {
           MPC_SUCCESS(NULL);
         } else {
-          MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
+          MPC_FAILURE(mpc_err_new(i->filename, mpc_state_at(i->pos), "anchor", mpc_input_peekc(i)));
         }
       
       /* Application Parsers */
@@ -1017,7 +2010,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
+            MPC_FAILURE(mpc_err_new(i->filename, mpc_state_at(i->pos), p->data.expect.m, mpc_input_peekc(i)));
           }
         }
       
@@ -1025,7 +2018,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(p->data.apply.f(r.output));
+            MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.apply.f(r.output));
           } else {
             MPC_FAILURE(r.error);
           }
@@ -1035,7 +2028,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 0) { MPC_CONTINUE(1, p->data.apply_to.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
+            MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.apply_to.f(r.output, p->data.apply_to.d));
           } else {
             MPC_FAILURE(r.error);
           }
@@ -1058,12 +2051,12 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
             mpc_input_rewind(i);
-            p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
+            if (!MPC_SPANNING) { p->data.not.dx(r.output); }
+            MPC_FAILURE(mpc_err_new(i->filename, mpc_state_at(i->pos), "opposite", mpc_input_peekc(i)));
           } else {
             mpc_input_unmark(i);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.not.lf());
           }
         }
       
@@ -1074,7 +2067,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.not.lf());
           }
         }
       
@@ -1088,7 +2081,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             mpc_stack_popr(stk, &r);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+            MPC_SUCCESS(mpc_stack_merger_span(stk, i, st-1, p->data.repeat.f));
           }
         }
       
@@ -1104,7 +2097,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_SUCCESS(mpc_stack_merger_span(stk, i, st-1, p->data.repeat.f));
             }
           }
         }
@@ -1117,14 +2110,18 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           } else {
             if (st != (p->data.repeat.n+1)) {
               mpc_stack_popr(stk, &r);
-              mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
+              if (MPC_SPANNING) {
+                mpc_stack_popr_n(stk, st-1);
+              } else {
+                mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
+              }
               mpc_input_rewind(i);
               MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
               mpc_input_unmark(i);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_SUCCESS(mpc_stack_merger_span(stk, i, st-1, p->data.repeat.f));
             }
           }
         }
@@ -1148,40 +2145,221 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       case MPC_TYPE_AND:
         
-        if (p->data.or.n == 0) { MPC_SUCCESS(p->data.and.f(0, NULL)); }
+        if (p->data.or.n == 0) { MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.and.f(0, NULL)); }
         
         if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
         if (st <= p->data.and.n) {
           if (!mpc_stack_peekr(stk, &r)) {
             mpc_input_rewind(i);
             mpc_stack_popr(stk, &r);
-            mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
+            if (MPC_SPANNING) {
+              mpc_stack_popr_n(stk, st-1);
+            } else {
+              mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
+            }
             MPC_FAILURE(r.error);
           }
           if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
-          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
+          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_span(stk, i, p->data.and.n, p->data.and.f)); }
+        }
+      
+      /* Accumulating Parsers */
+      
+      case MPC_TYPE_MANY_ACC:
+      case MPC_TYPE_MANY1_ACC:
+        if (st == 0) { MPC_CONTINUE(1, p->data.acc.x); }
+        if (mpc_stack_popr(stk, &r)) {
+          if (st == 1) { mpc_stack_pushr(stk, mpc_result_out(MPC_SPANNING ? NULL : p->data.acc.lf()), 1); }
+          mpc_stack_peekr(stk, &a);
+          if (!MPC_SPANNING) { mpc_stack_setr_out(stk, p->data.acc.f(a.output, r.output)); }
+          MPC_CONTINUE(2, p->data.acc.x);
+        }
+        if (st == 1 && p->type == MPC_TYPE_MANY1_ACC) { MPC_FAILURE(mpc_err_many1(r.error)); }
+        mpc_stack_err(stk, r.error);
+        if (st > 1) {
+          mpc_stack_popr(stk, &a);
+          MPC_SUCCESS(a.output);
         }
+        MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.acc.lf());
+      
+      /* Span Parsers */
+      
+      case MPC_TYPE_SPAN:
+        if (st == 0 && p->data.span.prog && mpc_prog_ready(i, stk)) {
+          last = i->last;
+          mpc_input_span_open(i);
+          if (mpc_prog_run(p->data.span.prog, i, &far)) {
+            mpc_stack_defer(stk, p, i->spans[0], last, far);
+            MPC_SUCCESS(mpc_input_span_close(i));
+          }
+          /* The body is run again to make its error */
+          i->spans_num--;
+        }
+        if (st == 0) { mpc_input_span_open(i); MPC_CONTINUE(1, p->data.span.x); }
+        if (st == 1) {
+          if (mpc_stack_popr(stk, &r)) {
+            MPC_SUCCESS(mpc_input_span_close(i));
+          } else {
+            i->spans_num--;
+            MPC_FAILURE(r.error);
+          }
+        }
+      
+      /* Memo Parsers */
+      
+      case MPC_TYPE_MEMO:
+        if (st == 0) {
+          m = mpc_stack_memo_find(stk, p, i->pos);
+          if (m) {
+            i->stats.memo_hits++;
+            mpc_stack_err(stk, mpc_err_copy(m->errs));
+            mpc_input_jump(i, m->end, m->last);
+            if (m->ok) {
+              MPC_SUCCESS(MPC_SPANNING ? NULL : p->data.memo.copy(m->r.output));
+            } else {
+              MPC_FAILURE(mpc_err_copy(m->r.error));
+            }
+          }
+          /* Values are not built while spanning so there is nothing to keep */
+          if (MPC_SPANNING) { MPC_CONTINUE(2, p->data.memo.x); }
+          mpc_stack_memo_open(stk, i->pos);
+          MPC_CONTINUE(1, p->data.memo.x);
+        }
+        if (st == 1) { mpc_stack_memo_close(stk, p, i->pos, i->last); }
+        mpc_stack_popp(stk, &p, &st);
+        continue;
       
       /* End */
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(mpc_err_fail(i->filename, mpc_state_at(i->pos), "Unknown Parser Type Id!"));
     }
   }
   
-  return mpc_stack_terminate(stk, final);
+  return 1;
+  
+}
+
+#undef MPC_CONTINUE
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMATIVE
+#undef MPC_SPANNING
+
+/*
+** Runs the body of a span matched by its program
+** again, from where it started, to find the errors
+** it merged in along the way.
+*/
+
+static mpc_err_t *mpc_parse_replay(mpc_input_t *i, const mpc_defer_t *d) {
+  
+  mpc_result_t r;
+  mpc_err_t *e;
+  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  
+  mpc_input_jump(i, d->pos, d->last);
+  mpc_input_span_open(i);
+  mpc_stack_pushp(stk, d->p->data.span.x);
+  mpc_parse_run(i, stk);
+  i->spans_num--;
+  
+  if (!mpc_stack_popr(stk, &r)) { mpc_stack_err(stk, r.error); }
+  
+  e = stk->err;
+  mpc_stack_delete(stk);
+  return e;
+}
+
+static void mpc_parse_undefer(mpc_input_t *i, mpc_stack_t *stk) {
+  
+  int j;
+  long pos = i->pos;
+  char last = i->last;
+  long furthest = stk->err->state.pos;
+  mpc_err_t *errs[2];
+  
+  if (stk->defers_num == 0) { return; }
+  
+  if (stk->returns[0]) {
+    for (j = 0; j < stk->defers_num; j++) { mpc_err_delete(stk->defers[j].err); }
+    stk->defers_num = 0;
+    return;
+  }
+  
+  if (stk->results[0].error->state.pos > furthest) { furthest = stk->results[0].error->state.pos; }
+  for (j = 0; j < stk->defers_num; j++) {
+    if (stk->defers[j].err->state.pos > furthest) { furthest = stk->defers[j].err->state.pos; }
+  }
+  
+  /* Merge everything in the order it would have been */
+  errs[0] = stk->defers[0].err;
+  for (j = 0; j < stk->defers_num; j++) {
+    if (j > 0) {
+      errs[1] = stk->defers[j].err;
+      errs[0] = mpc_err_or(errs, 2);
+    }
+    if (stk->defers[j].far >= furthest) {
+      errs[1] = mpc_parse_replay(i, &stk->defers[j]);
+      errs[0] = mpc_err_or(errs, 2);
+    }
+  }
+  
+  errs[1] = stk->err;
+  stk->err = mpc_err_or(errs, 2);
+  stk->defers_num = 0;
+  
+  mpc_input_jump(i, pos, last);
+}
+
+static int mpc_parse_terminate(mpc_input_t *i, mpc_stack_t *stk, mpc_result_t *final) {
+  
+  int x;
+  
+  mpc_parse_undefer(i, stk);
+  x = mpc_stack_terminate(stk, final);
+  
+  /* Errors only carry an offset until here */
+  if (!x && final->error->state.pos >= 0) {
+    final->error->state = mpc_input_state(i, final->error->state.pos);
+  }
   
+  return x;
 }
 
-#undef MPC_CONTINUE
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMATIVE
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  mpc_stack_t *stk = mpc_stack_new(i->filename);
+  mpc_stack_pushp(stk, init);
+  mpc_parse_run(i, stk);
+  return mpc_parse_terminate(i, stk, final);
+}
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_n(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse_n(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_stats(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r, mpc_stats_t *s) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  *s = i->stats;
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_interpreted(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
+  i->programs = 0;
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1203,6 +2381,48 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+/*
+** A session owns a Pipe with no File behind it, and
+** the stack of a parse that is suspended whenever it
+** runs out of what has been fed to it so far.
+*/
+
+struct mpc_session_t {
+  mpc_input_t *input;
+  mpc_stack_t *stack;
+  int done;
+};
+
+mpc_session_t *mpc_parser_session_new(const char *filename, mpc_parser_t *p) {
+  mpc_session_t *s = malloc(sizeof(mpc_session_t));
+  s->input = mpc_input_new_pipe(filename, NULL);
+  s->input->feeding = 1;
+  s->stack = mpc_stack_new(filename);
+  mpc_stack_pushp(s->stack, p);
+  s->done = 0;
+  return s;
+}
+
+int mpc_parser_session_feed(mpc_session_t *s, const char *chunk, long length) {
+  if (s->done) { return 0; }
+  mpc_input_pipe_feed(s->input, chunk, length);
+  s->done = mpc_parse_run(s->input, s->stack);
+  return !s->done;
+}
+
+int mpc_parser_session_finish(mpc_session_t *s, mpc_result_t *r) {
+  
+  int x;
+  
+  s->input->feeding = 0;
+  if (!s->done) { mpc_parse_run(s->input, s->stack); }
+  
+  x = mpc_parse_terminate(s->input, s->stack, r);
+  mpc_input_delete(s->input);
+  free(s);
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
@@ -1263,6 +2483,16 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_SPAN:
+      mpc_undefine_unretained(p->data.span.x, 0);
+      if (p->data.span.prog) { mpc_prog_delete(p->data.span.prog); }
+      break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_MANY_ACC:
+    case MPC_TYPE_MANY1_ACC:
+      mpc_undefine_unretained(p->data.acc.x, 0);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1576,6 +2806,23 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_span(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SPAN;
+  p->data.span.x = a;
+  p->data.span.prog = mpc_prog_new(a);
+  return p;
+}
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.copy = copy;
+  p->data.memo.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1617,6 +2864,21 @@ mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_many_acc(mpc_acc_t f, mpc_ctor_t lf, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY_ACC;
+  p->data.acc.f = f;
+  p->data.acc.lf = lf;
+  p->data.acc.x = a;
+  return p;
+}
+
+mpc_parser_t *mpc_many1_acc(mpc_acc_t f, mpc_ctor_t lf, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_many_acc(f, lf, a);
+  p->type = MPC_TYPE_MANY1_ACC;
+  return p;
+}
+
 mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_COUNT;
@@ -1676,13 +2938,13 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
 ** Common Parsers
 */
 
-static int mpc_soi_anchor(char prev, char next) { return (prev == '\0'); }
-static int mpc_eoi_anchor(char prev, char next) { return (next == '\0'); }
+int mpc_soi_anchor(char prev, char next) { return (prev == '\0'); }
+int mpc_eoi_anchor(char prev, char next) { return (next == '\0'); }
 
 mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
 mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
 
-static int mpc_boundary_anchor(char prev, char next) {
+int mpc_boundary_anchor(char prev, char next) {
   char* word = "abcdefghijklmnopqrstuvwxyz"
                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
                "0123456789_";
@@ -1696,19 +2958,19 @@ static int mpc_boundary_anchor(char prev, char next) {
 mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
 
 mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_span(mpc_many(mpcf_strfold, mpc_whitespace())), "spaces"); }
 mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
 
 mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
 mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+mpc_parser_t *mpc_escape(void) { return mpc_span(mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free)); }
 
 mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
 mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
 mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_span(mpc_many1(mpcf_strfold, mpc_digit())), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_span(mpc_many1(mpcf_strfold, mpc_hexdigit())), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_span(mpc_many1(mpcf_strfold, mpc_octdigit())), "oct digits"); }
 
 mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
 mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
@@ -1735,7 +2997,7 @@ mpc_parser_t *mpc_real(void) {
   p32 = mpc_digits();
   p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
   
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+  return mpc_expect(mpc_span(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free)), "real");
 
 }
 
@@ -1749,19 +3011,19 @@ mpc_parser_t *mpc_char_lit(void) {
 
 mpc_parser_t *mpc_string_lit(void) {
   mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+  return mpc_expect(mpc_between(mpc_span(mpc_many(mpcf_strfold, strchar)), free, "\"", "\""), "string");
 }
 
 mpc_parser_t *mpc_regex_lit(void) {  
   mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+  return mpc_expect(mpc_between(mpc_span(mpc_many(mpcf_strfold, regexchar)), free, "/", "/"), "regex");
 }
 
 mpc_parser_t *mpc_ident(void) {
   mpc_parser_t *p0, *p1; 
   p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
   p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+  return mpc_span(mpc_and(2, mpcf_strfold, p0, p1, free));
 }
 
 /*
@@ -2057,6 +3319,9 @@ mpc_parser_t *mpc_re(const char *re) {
     mpc_err_delete(r.error);  
     free(err_msg);
     r.output = err_out;
+  } else {
+    /* The value of a regex is always the text it matched */
+    r.output = mpc_span(r.output);
   }
   
   mpc_delete(RegexEnclose);
@@ -2257,13 +3522,24 @@ mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1)
 mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+  
+  char *x;
+  size_t len = 0, l;
   int i;
+  
+  /* Size the result first so each piece is copied once */
+  for (i = 0; i < n; i++) { len += strlen(xs[i]); }
+  
+  x = malloc(len + 1);
+  len = 0;
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-    strcat(x, xs[i]);
+    l = strlen(xs[i]);
+    memcpy(x + len, xs[i], l);
+    len += l;
     free(xs[i]);
   }
+  x[len] = '\0';
+  
   return x;
 }
 
@@ -2370,12 +3646,16 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_print_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
 
   if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
   if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+  if (p->type == MPC_TYPE_MANY_ACC)  { mpc_print_unretained(p->data.acc.x, 0); printf("*"); }
+  if (p->type == MPC_TYPE_MANY1_ACC) { mpc_print_unretained(p->data.acc.x, 0); printf("+"); }
   if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
   
   if (p->type == MPC_TYPE_OR) {
@@ -2405,6 +3685,476 @@ void mpc_print(mpc_parser_t *p) {
   printf("\n");
 }
 
+/*
+** Code Generation
+**
+** `mpc_codegen` writes C source that defines a
+** parser graph as static data, so a program can
+** link in a grammar ready-made rather than build
+** it with `mpca_lang` every time it starts. Each
+** node reachable from the given parsers becomes a
+** static `mpc_parser_t`, and the parsers given are
+** listed in order in an array named `prefix`.
+**
+** Functions in the graph are written by name, so
+** only those in the table below can be used. If
+** `mpc_codegen` meets any other function, or a
+** lifted value it cannot write, it returns 0 and
+** the output is incomplete.
+*/
+
+typedef void(*mpc_codegen_fn_t)(void);
+
+#define MPC_CODEGEN_FN(f) { #f, (mpc_codegen_fn_t)f }
+
+static const struct {
+  const char *name;
+  mpc_codegen_fn_t f;
+} mpc_codegen_fns[] = {
+  MPC_CODEGEN_FN(free),
+  MPC_CODEGEN_FN(mpcf_dtor_null),
+  MPC_CODEGEN_FN(mpcf_ctor_null),
+  MPC_CODEGEN_FN(mpcf_ctor_str),
+  MPC_CODEGEN_FN(mpcf_free),
+  MPC_CODEGEN_FN(mpcf_int),
+  MPC_CODEGEN_FN(mpcf_hex),
+  MPC_CODEGEN_FN(mpcf_oct),
+  MPC_CODEGEN_FN(mpcf_float),
+  MPC_CODEGEN_FN(mpcf_escape),
+  MPC_CODEGEN_FN(mpcf_escape_string_raw),
+  MPC_CODEGEN_FN(mpcf_escape_char_raw),
+  MPC_CODEGEN_FN(mpcf_unescape),
+  MPC_CODEGEN_FN(mpcf_unescape_regex),
+  MPC_CODEGEN_FN(mpcf_unescape_string_raw),
+  MPC_CODEGEN_FN(mpcf_unescape_char_raw),
+  MPC_CODEGEN_FN(mpcf_null),
+  MPC_CODEGEN_FN(mpcf_fst),
+  MPC_CODEGEN_FN(mpcf_snd),
+  MPC_CODEGEN_FN(mpcf_trd),
+  MPC_CODEGEN_FN(mpcf_fst_free),
+  MPC_CODEGEN_FN(mpcf_snd_free),
+  MPC_CODEGEN_FN(mpcf_trd_free),
+  MPC_CODEGEN_FN(mpcf_strfold),
+  MPC_CODEGEN_FN(mpcf_maths),
+  MPC_CODEGEN_FN(mpcf_fold_ast),
+  MPC_CODEGEN_FN(mpcf_acc_ast),
+  MPC_CODEGEN_FN(mpcf_str_ast),
+  MPC_CODEGEN_FN(mpcf_state_ast),
+  MPC_CODEGEN_FN(mpcf_copy_ast),
+  MPC_CODEGEN_FN(mpc_ast_delete),
+  MPC_CODEGEN_FN(mpc_ast_add_root),
+  MPC_CODEGEN_FN(mpc_ast_tag),
+  MPC_CODEGEN_FN(mpc_ast_add_tag),
+  MPC_CODEGEN_FN(mpc_soi_anchor),
+  MPC_CODEGEN_FN(mpc_eoi_anchor),
+  MPC_CODEGEN_FN(mpc_boundary_anchor),
+  MPC_CODEGEN_FN(mpcaf_str_ast_string),
+  MPC_CODEGEN_FN(mpcaf_str_ast_char),
+  MPC_CODEGEN_FN(mpcaf_str_ast_regex),
+  MPC_CODEGEN_FN(mpcaf_grammar_add_rule),
+  { NULL, NULL }
+};
+
+typedef struct {
+  FILE *f;
+  const char *prefix;
+  int failed;
+  int parsers_num;
+  int parsers_slots;
+  mpc_parser_t **parsers;
+} mpc_codegen_t;
+
+static int mpc_codegen_index(mpc_codegen_t *g, mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < g->parsers_num; i++) {
+    if (g->parsers[i] == p) { return i; }
+  }
+  return -1;
+}
+
+static void mpc_codegen_collect(mpc_codegen_t *g, mpc_parser_t *p) {
+  
+  int i;
+  
+  if (mpc_codegen_index(g, p) >= 0) { return; }
+  
+  if (g->parsers_num == g->parsers_slots) {
+    g->parsers_slots = g->parsers_slots ? g->parsers_slots * 2 : 64;
+    g->parsers = realloc(g->parsers, sizeof(mpc_parser_t*) * g->parsers_slots);
+  }
+  g->parsers[g->parsers_num++] = p;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_codegen_collect(g, p->data.expect.x); break;
+    case MPC_TYPE_APPLY:    mpc_codegen_collect(g, p->data.apply.x); break;
+    case MPC_TYPE_APPLY_TO: mpc_codegen_collect(g, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_codegen_collect(g, p->data.predict.x); break;
+    case MPC_TYPE_SPAN:     mpc_codegen_collect(g, p->data.span.x); break;
+    case MPC_TYPE_MEMO:     mpc_codegen_collect(g, p->data.memo.x); break;
+    case MPC_TYPE_MANY_ACC:
+    case MPC_TYPE_MANY1_ACC: mpc_codegen_collect(g, p->data.acc.x); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    mpc_codegen_collect(g, p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_codegen_collect(g, p->data.repeat.x); break;
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_codegen_collect(g, p->data.or.xs[i]); }
+    break;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_codegen_collect(g, p->data.and.xs[i]); }
+    break;
+    default: break;
+  }
+  
+  if (p->type == MPC_TYPE_APPLY_TO
+  &&  p->data.apply_to.f == mpcaf_grammar_add_rule) {
+    mpc_codegen_collect(g, p->data.apply_to.d);
+  }
+  
+}
+
+/* Write a string as a C literal, with octal escapes for anything unusual */
+static void mpc_codegen_string(mpc_codegen_t *g, const char *s) {
+  
+  if (s == NULL) { fprintf(g->f, "NULL"); return; }
+  
+  fputc('"', g->f);
+  while (*s) {
+    if (*s == '"' || *s == '\\' || *s == '?' || *s < ' ' || *s > '~') {
+      fprintf(g->f, "\\%03o", (unsigned char)*s);
+    } else {
+      fputc(*s, g->f);
+    }
+    s++;
+  }
+  fputc('"', g->f);
+}
+
+static void mpc_codegen_fn(mpc_codegen_t *g, const char *cast, mpc_codegen_fn_t f) {
+  
+  int i;
+  
+  if (f == NULL) { fprintf(g->f, "NULL"); return; }
+  
+  for (i = 0; mpc_codegen_fns[i].name; i++) {
+    if (mpc_codegen_fns[i].f == f) {
+      fprintf(g->f, "(%s)%s", cast, mpc_codegen_fns[i].name);
+      return;
+    }
+  }
+  
+  fprintf(g->f, "NULL");
+  g->failed = 1;
+}
+
+static void mpc_codegen_ref(mpc_codegen_t *g, mpc_parser_t *p) {
+  fprintf(g->f, "&%s_%i", g->prefix, mpc_codegen_index(g, p));
+}
+
+static void mpc_codegen_node(mpc_codegen_t *g, int i) {
+  
+  mpc_parser_t *p = g->parsers[i];
+  
+  fprintf(g->f, "static mpc_parser_t %s_%i = { %i, ", g->prefix, i, p->retained);
+  mpc_codegen_string(g, p->name);
+  fprintf(g->f, ", %i, %i, { ", p->type, p->id);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL:
+      fprintf(g->f, ".fail = { ");
+      mpc_codegen_string(g, p->data.fail.m);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_LIFT:
+      fprintf(g->f, ".lift = { ");
+      mpc_codegen_fn(g, "mpc_ctor_t", (mpc_codegen_fn_t)p->data.lift.lf);
+      fprintf(g->f, ", NULL }");
+    break;
+    
+    case MPC_TYPE_LIFT_VAL:
+      fprintf(g->f, ".lift = { NULL, NULL }");
+      if (p->data.lift.x != NULL) { g->failed = 1; }
+    break;
+    
+    case MPC_TYPE_EXPECT:
+      fprintf(g->f, ".expect = { ");
+      mpc_codegen_ref(g, p->data.expect.x);
+      fprintf(g->f, ", ");
+      mpc_codegen_string(g, p->data.expect.m);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_ANCHOR:
+      fprintf(g->f, ".anchor = { ");
+      mpc_codegen_fn(g, "int(*)(char,char)", (mpc_codegen_fn_t)p->data.anchor.f);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_SINGLE:
+      fprintf(g->f, ".single = { %i }", p->data.single.x);
+    break;
+    
+    case MPC_TYPE_RANGE:
+      fprintf(g->f, ".range = { %i, %i }", p->data.range.x, p->data.range.y);
+    break;
+    
+    case MPC_TYPE_SATISFY:
+      fprintf(g->f, ".satisfy = { ");
+      mpc_codegen_fn(g, "int(*)(char)", (mpc_codegen_fn_t)p->data.satisfy.f);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      fprintf(g->f, ".string = { ");
+      mpc_codegen_string(g, p->data.string.x);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_APPLY:
+      fprintf(g->f, ".apply = { ");
+      mpc_codegen_ref(g, p->data.apply.x);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_apply_t", (mpc_codegen_fn_t)p->data.apply.f);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_APPLY_TO:
+      fprintf(g->f, ".apply_to = { ");
+      mpc_codegen_ref(g, p->data.apply_to.x);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_apply_to_t", (mpc_codegen_fn_t)p->data.apply_to.f);
+      fprintf(g->f, ", ");
+      
+      /* The data is the rule for `mpcaf_grammar_add_rule` and a tag for the tagging functions */
+      if (p->data.apply_to.d == NULL) {
+        fprintf(g->f, "NULL");
+      } else if (p->data.apply_to.f == mpcaf_grammar_add_rule) {
+        mpc_codegen_ref(g, p->data.apply_to.d);
+      } else if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      ||         p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        fprintf(g->f, "(void*)");
+        mpc_codegen_string(g, p->data.apply_to.d);
+      } else {
+        fprintf(g->f, "NULL");
+        g->failed = 1;
+      }
+      
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_PREDICT:
+      fprintf(g->f, ".predict = { ");
+      mpc_codegen_ref(g, p->data.predict.x);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_SPAN:
+      fprintf(g->f, ".span = { ");
+      mpc_codegen_ref(g, p->data.span.x);
+      if (p->data.span.prog) {
+        fprintf(g->f, ", %s_%i_prog }", g->prefix, i);
+      } else {
+        fprintf(g->f, ", NULL }");
+      }
+    break;
+    
+    case MPC_TYPE_MEMO:
+      fprintf(g->f, ".memo = { ");
+      mpc_codegen_ref(g, p->data.memo.x);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_apply_t", (mpc_codegen_fn_t)p->data.memo.copy);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.memo.dx);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      fprintf(g->f, ".not = { ");
+      mpc_codegen_ref(g, p->data.not.x);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.not.dx);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_ctor_t", (mpc_codegen_fn_t)p->data.not.lf);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      fprintf(g->f, ".repeat = { %i, ", p->data.repeat.n);
+      mpc_codegen_fn(g, "mpc_fold_t", (mpc_codegen_fn_t)p->data.repeat.f);
+      fprintf(g->f, ", ");
+      mpc_codegen_ref(g, p->data.repeat.x);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.repeat.dx);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_MANY_ACC:
+    case MPC_TYPE_MANY1_ACC:
+      fprintf(g->f, ".acc = { ");
+      mpc_codegen_fn(g, "mpc_acc_t", (mpc_codegen_fn_t)p->data.acc.f);
+      fprintf(g->f, ", ");
+      mpc_codegen_fn(g, "mpc_ctor_t", (mpc_codegen_fn_t)p->data.acc.lf);
+      fprintf(g->f, ", ");
+      mpc_codegen_ref(g, p->data.acc.x);
+      fprintf(g->f, " }");
+    break;
+    
+    case MPC_TYPE_OR:
+      fprintf(g->f, ".or = { %i, %s_%i_xs }", p->data.or.n, g->prefix, i);
+    break;
+    
+    case MPC_TYPE_AND:
+      fprintf(g->f, ".and = { %i, ", p->data.and.n);
+      mpc_codegen_fn(g, "mpc_fold_t", (mpc_codegen_fn_t)p->data.and.f);
+      fprintf(g->f, ", %s_%i_xs, %s_%i_dxs }", g->prefix, i, g->prefix, i);
+    break;
+    
+    default:
+      fprintf(g->f, "{ 0 }");
+    break;
+  }
+  
+  fprintf(g->f, " } };\n");
+}
+
+/* Write the program of a span, and the character sets it uses */
+static void mpc_codegen_prog(mpc_codegen_t *g, int i, const mpc_inst_t *prog) {
+  
+  int j, k;
+  
+  for (j = 0; prog[j].op != MPC_OP_END; j++) {
+    if (prog[j].op != MPC_OP_SET && prog[j].op != MPC_OP_SPAN) { continue; }
+    fprintf(g->f, "static unsigned char %s_%i_set_%i[] = { ", g->prefix, i, j);
+    for (k = 0; k < 32; k++) {
+      fprintf(g->f, k < 31 ? "%i, " : "%i };\n", prog[j].data.set[k]);
+    }
+  }
+  
+  fprintf(g->f, "static mpc_inst_t %s_%i_prog[] = {\n", g->prefix, i);
+  
+  for (j = 0; ; j++) {
+    
+    fprintf(g->f, "  { %i, %i, { ", prog[j].op, prog[j].x);
+    
+    switch (prog[j].op) {
+      case MPC_OP_SET:
+      case MPC_OP_SPAN:
+        fprintf(g->f, ".set = %s_%i_set_%i", g->prefix, i, j);
+      break;
+      case MPC_OP_STRING:
+        fprintf(g->f, ".s = ");
+        mpc_codegen_string(g, prog[j].data.s);
+      break;
+      case MPC_OP_SATISFY:
+        fprintf(g->f, ".satisfy = ");
+        mpc_codegen_fn(g, "int(*)(char)", (mpc_codegen_fn_t)prog[j].data.satisfy);
+      break;
+      case MPC_OP_ANCHOR:
+        fprintf(g->f, ".anchor = ");
+        mpc_codegen_fn(g, "int(*)(char,char)", (mpc_codegen_fn_t)prog[j].data.anchor);
+      break;
+      default:
+        fprintf(g->f, "NULL");
+      break;
+    }
+    
+    fprintf(g->f, " } },\n");
+    if (prog[j].op == MPC_OP_END) { break; }
+  }
+  
+  fprintf(g->f, "};\n");
+}
+
+/* Write the child arrays of an `or` or `and` node, and the program of a span */
+static void mpc_codegen_arrays(mpc_codegen_t *g, int i) {
+  
+  int j;
+  mpc_parser_t *p = g->parsers[i];
+  
+  if (p->type == MPC_TYPE_SPAN && p->data.span.prog) {
+    mpc_codegen_prog(g, i, p->data.span.prog);
+  }
+  
+  if (p->type == MPC_TYPE_OR) {
+    fprintf(g->f, "static mpc_parser_t *%s_%i_xs[] = { ", g->prefix, i);
+    for (j = 0; j < p->data.or.n; j++) {
+      mpc_codegen_ref(g, p->data.or.xs[j]);
+      fprintf(g->f, j < p->data.or.n-1 ? ", " : " };\n");
+    }
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    fprintf(g->f, "static mpc_parser_t *%s_%i_xs[] = { ", g->prefix, i);
+    for (j = 0; j < p->data.and.n; j++) {
+      mpc_codegen_ref(g, p->data.and.xs[j]);
+      fprintf(g->f, j < p->data.and.n-1 ? ", " : " };\n");
+    }
+    fprintf(g->f, "static mpc_dtor_t %s_%i_dxs[] = { ", g->prefix, i);
+    for (j = 0; j < p->data.and.n-1; j++) {
+      mpc_codegen_fn(g, "mpc_dtor_t", (mpc_codegen_fn_t)p->data.and.dxs[j]);
+      fprintf(g->f, ", ");
+    }
+    fprintf(g->f, "NULL };\n");
+  }
+  
+}
+
+int mpc_codegen(FILE *f, const char *prefix, int n, ...) {
+  
+  int i;
+  va_list va;
+  mpc_codegen_t g;
+  mpc_parser_t **ps = malloc(sizeof(mpc_parser_t*) * n);
+  
+  g.f = f;
+  g.prefix = prefix;
+  g.failed = 0;
+  g.parsers_num = 0;
+  g.parsers_slots = 0;
+  g.parsers = NULL;
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    ps[i] = va_arg(va, mpc_parser_t*);
+    mpc_codegen_collect(&g, ps[i]);
+  }
+  va_end(va);
+  
+  fprintf(f, "/* Generated by mpc_codegen. Do not edit. */\n\n");
+  fprintf(f, "#define MPC_PARSER_INTERNALS\n#include \"mpc.h\"\n\n");
+  
+  /* Declare every node first, as the graph can have cycles */
+  for (i = 0; i < g.parsers_num; i++) {
+    fprintf(f, "static mpc_parser_t %s_%i;\n", prefix, i);
+  }
+  fprintf(f, "\n");
+  
+  for (i = 0; i < g.parsers_num; i++) { mpc_codegen_arrays(&g, i); }
+  fprintf(f, "\n");
+  
+  for (i = 0; i < g.parsers_num; i++) { mpc_codegen_node(&g, i); }
+  fprintf(f, "\n");
+  
+  fprintf(f, "mpc_parser_t *%s[] = { ", prefix);
+  for (i = 0; i < n; i++) {
+    mpc_codegen_ref(&g, ps[i]);
+    fprintf(f, i < n-1 ? ", " : " };\n");
+  }
+  
+  free(ps);
+  free(g.parsers);
+  
+  return !g.failed && !ferror(f);
+}
+
 /*
 ** Testing
 */
@@ -2509,6 +4259,7 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   strcpy(a->contents, contents);
   
   a->state = mpc_state_new();
+  a->id = MPC_AST_NONE;
   
   a->children_num = 0;
   a->children = NULL;
@@ -2584,6 +4335,19 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
   return a;
 }
 
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, const char *t, int id) {
+  if (a == NULL) { return a; }
+  mpc_ast_add_tag(a, t);
+  if (a->id <= MPC_AST_NONE) { a->id = id; }
+  return a;
+}
+
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, const char *t, int id) {
+  mpc_ast_tag(a, t);
+  a->id = id;
+  return a;
+}
+
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
   a->state = s;
@@ -2596,7 +4360,7 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
   
   if (strlen(a->contents)) {
-    fprintf(fp, "%s:%i:%i '%s'\n", a->tag, a->state.row+1, a->state.col+1, a->contents);
+    fprintf(fp, "%s:%li:%li '%s'\n", a->tag, a->state.row+1, a->state.col+1, a->contents);
   } else {
     fprintf(fp, "%s \n", a->tag);
   }
@@ -2653,6 +4417,45 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   return r;
 }
 
+/*
+** Gives the same tree as `mpcf_fold_ast` over all the
+** values, but builds it one value at a time. Once
+** there is more than one value they are gathered as
+** children of a new ">" node, which later values are
+** added to directly.
+*/
+
+static void mpcf_acc_ast_add(mpc_ast_t *r, mpc_ast_t *a) {
+  
+  int j;
+  
+  if (a->children_num == 0) { mpc_ast_add_child(r, a); return; }
+  
+  for (j = 0; j < a->children_num; j++) {
+    mpc_ast_add_child(r, a->children[j]);
+  }
+  
+  mpc_ast_delete_no_children(a);
+}
+
+mpc_val_t *mpcf_acc_ast(mpc_val_t *a, mpc_val_t *x) {
+  
+  mpc_ast_t *r = a;
+  
+  if (a == NULL) { return x; }
+  if (x == NULL) { return a; }
+  
+  if (r->children_num == 0 || strcmp(r->tag, ">") != 0 || strcmp(r->contents, "") != 0) {
+    r = mpc_ast_new(">", "");
+    mpcf_acc_ast_add(r, a);
+  }
+  
+  mpcf_acc_ast_add(r, x);
+  r->state = r->children[0]->state;
+  
+  return r;
+}
+
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   mpc_ast_t *a = mpc_ast_new("", c);
   free(c);
@@ -2667,6 +4470,27 @@ mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
   return a;
 }
 
+mpc_val_t *mpcf_copy_ast(mpc_val_t *a) {
+  
+  int i;
+  mpc_ast_t *x = a;
+  mpc_ast_t *r;
+  
+  if (x == NULL) { return NULL; }
+  
+  r = mpc_ast_new(x->tag, x->contents);
+  r->state = x->state;
+  r->id = x->id;
+  r->children_num = x->children_num;
+  r->children = x->children_num ? malloc(sizeof(mpc_ast_t*) * x->children_num) : NULL;
+  
+  for (i = 0; i < x->children_num; i++) {
+    r->children[i] = mpcf_copy_ast(x->children[i]);
+  }
+  
+  return r;
+}
+
 mpc_parser_t *mpca_state(mpc_parser_t *a) {
   return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
@@ -2736,6 +4560,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, mpcf_copy_ast, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
 ** Grammar Parser
@@ -2815,12 +4640,16 @@ static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
   return mpca_count(num, xs[0]);
 }
 
+mpc_val_t *mpcaf_str_ast_string(mpc_val_t *c) { return mpc_ast_tag_id(mpcf_str_ast(c), "string", MPC_AST_STRING); }
+mpc_val_t *mpcaf_str_ast_char(mpc_val_t *c) { return mpc_ast_tag_id(mpcf_str_ast(c), "char", MPC_AST_CHAR); }
+mpc_val_t *mpcaf_str_ast_regex(mpc_val_t *c) { return mpc_ast_tag_id(mpcf_str_ast(c), "regex", MPC_AST_REGEX); }
+
 static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  return mpca_state(mpc_apply(p, mpcaf_str_ast_string));
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
@@ -2828,7 +4657,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+  return mpca_state(mpc_apply(p, mpcaf_str_ast_char));
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
@@ -2836,7 +4665,7 @@ static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape_regex(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+  return mpca_state(mpc_apply(p, mpcaf_str_ast_regex));
 }
 
 /* Should this just use `isdigit` instead */
@@ -2863,6 +4692,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       if (st->parsers[st->parsers_num-1] == NULL) {
         return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
+      st->parsers[st->parsers_num-1]->id = st->parsers_num;
     }
     
     return st->parsers[st->parsers_num-1];
@@ -2887,6 +4717,7 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
       st->parsers[st->parsers_num-1] = p;
       
       if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      p->id = st->parsers_num;
       if (p->name && strcmp(p->name, x) == 0) { return p; }
       
     }
@@ -2895,6 +4726,11 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
   
 }
 
+mpc_val_t *mpcaf_grammar_add_rule(mpc_val_t *x, void *p) {
+  mpc_parser_t *rule = p;
+  return mpc_ast_add_tag_id(x, rule->name, rule->id);
+}
+
 static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   
   mpca_grammar_st_t *st = s;
@@ -2902,7 +4738,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    return mpca_state(mpca_root(mpc_apply_to(p, mpcaf_grammar_add_rule, p)));
   } else {
     return mpca_state(mpca_root(p));
   }
@@ -3044,6 +4880,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
     free(stmt->name);
@@ -3176,7 +5013,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
+  i = mpc_input_new_string("<mpca_lang>", language, strlen(language));
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -21,10 +21,19 @@
 ** State Type
 */
 
+/*
+** Positions are longs, counted from where the
+** input starts. Inputs larger than 2 GB, and Files
+** read from an offset past 2 GB, are only supported
+** where long is 64 bits, as on LP64 platforms such
+** as 64-bit Linux and macOS. Elsewhere positions
+** past 2 GB overflow.
+*/
+
 typedef struct {
-  int pos;
-  int row;
-  int col;
+  long pos;
+  long row;
+  long col;
 } mpc_state_t;
 
 /*
@@ -59,11 +68,44 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+/*
+** A parse only reads the parser it is given, and
+** keeps all of its own state local to the call, so
+** once built a parser may be used by any number of
+** threads at once. Building, defining or deleting
+** parsers must not happen alongside parses that use
+** them.
+*/
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_n(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Incremental Parsing
+**
+** A session parses input that is pushed to it in
+** chunks, as it arrives. Each call to feed parses as
+** far as it can with what has been fed so far, and
+** returns 0 once the parse is complete and no more
+** input is wanted. Finish marks the end of the input,
+** completes the parse, and frees the session.
+**
+** `mpc_parse_pipe` reads its stream through stdio a
+** character at a time. To hand over input in larger
+** blocks as it arrives, for example whatever each
+** `read` on a socket returns, feed it to a session.
+*/
+
+struct mpc_session_t;
+typedef struct mpc_session_t mpc_session_t;
+
+mpc_session_t *mpc_parser_session_new(const char *filename, mpc_parser_t *p);
+int mpc_parser_session_feed(mpc_session_t *s, const char *chunk, long length);
+int mpc_parser_session_finish(mpc_session_t *s, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -74,6 +116,7 @@ typedef mpc_val_t*(*mpc_ctor_t)(void);
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
+typedef mpc_val_t*(*mpc_acc_t)(mpc_val_t*,mpc_val_t*);
 
 /*
 ** Building a Parser
@@ -128,11 +171,45 @@ mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a);
 mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a);
 mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da);
 
+/*
+** Like `mpc_many` and `mpc_many1` but each result is
+** passed to `f` along with the value so far as soon
+** as it is parsed, rather than all being kept until
+** the end. The first value is made with `lf`.
+*/
+
+mpc_parser_t *mpc_many_acc(mpc_acc_t f, mpc_ctor_t lf, mpc_parser_t *a);
+mpc_parser_t *mpc_many1_acc(mpc_acc_t f, mpc_ctor_t lf, mpc_parser_t *a);
+
 mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Returns the text matched by `a` as a single string.
+** The values `a` would have built are never made, and
+** no folds, applies or destructors inside `a` are run,
+** so this is only suitable when the matched text is
+** all that is wanted from `a`. Where `a` is built only
+** from parsers that match, with no named rules, it is
+** compiled when the span is made and run faster.
+*/
+
+mpc_parser_t *mpc_span(mpc_parser_t *a);
+
+/*
+** Remembers the result of `a` at each position for
+** the rest of the parse, so however often the parse
+** backtracks over it `a` only runs once at any one
+** position. Remembered values are handed out through
+** `copy` and freed with `da` at the end of the parse.
+** Every value is copied at least once, so it is best
+** kept to the rules the parse keeps coming back to.
+*/
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da);
+
 /*
 ** Common Parsers
 */
@@ -251,10 +328,36 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** Besides the string `tag`, every AST node carries
+** an integer `id`. Parsers built by `mpca_lang` and
+** `mpca_grammar` set it to the rule that matched the
+** node, numbered from 1 in the order the parsers are
+** passed in. Where several rules match the same node
+** the innermost one is kept, so for `expr|number|regex`
+** the id is that of `number`. Leaves matched by a
+** literal and not claimed by any rule have one of the
+** negative ids below, and other nodes have id 0.
+**
+** Unlike errors and marks, which hold only a byte
+** offset until the parse ends, a node keeps its full
+** `state`. Nodes outlive the input, and with it the
+** index of newlines that rows and columns are found
+** from, so they are filled in as the node is built.
+*/
+
+enum {
+  MPC_AST_NONE   =  0,
+  MPC_AST_STRING = -1,
+  MPC_AST_CHAR   = -2,
+  MPC_AST_REGEX  = -3
+};
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
+  int id;
   int children_num;
   struct mpc_ast_t** children;
 } mpc_ast_t;
@@ -265,6 +368,8 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, const char *t, int id);
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, const char *t, int id);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
 void mpc_ast_delete(mpc_ast_t *a);
@@ -277,14 +382,17 @@ void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
+mpc_val_t *mpcf_acc_ast(mpc_val_t *a, mpc_val_t *x);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
+mpc_val_t *mpcf_copy_ast(mpc_val_t *a);
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -299,7 +407,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -309,12 +418,43 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Code Generation
+*/
+
+int mpc_codegen(FILE *f, const char *prefix, int n, ...);
+
 /*
 ** Debug & Testing
 */
 
 void mpc_print(mpc_parser_t *p);
 
+/*
+** Counts of the backtracking bookkeeping done by one
+** parse: how many times the input was marked, the
+** deepest the stack of marks got, how many marks
+** were rewound to, and how many results were taken
+** from those remembered by `mpc_memo`.
+*/
+
+typedef struct {
+  long marks;
+  int marks_peak;
+  long rewinds;
+  long memo_hits;
+} mpc_stats_t;
+
+int mpc_parse_stats(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r, mpc_stats_t *s);
+
+/*
+** Parses as `mpc_parse_n` does, but without running
+** the programs that span bodies are compiled to, so
+** that the two can be compared.
+*/
+
+int mpc_parse_interpreted(const char *filename, const char *string, long length, mpc_parser_t *p, mpc_result_t *r);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
   int(*tester)(void*, void*), 
   mpc_dtor_t destructor, 
@@ -325,6 +465,155 @@ int mpc_test_fail(mpc_parser_t *p, const char *s, void *d,
   mpc_dtor_t destructor,
   void(*printer)(void*));
 
+/*
+** Parser Internals
+**
+** The layout of a parser is only visible when
+** `MPC_PARSER_INTERNALS` is defined before this
+** header is included. It is needed by the code
+** `mpc_codegen` writes, which defines parsers as
+** static data, along with the library functions
+** such parsers can refer to.
+*/
+
+#ifdef MPC_PARSER_INTERNALS
 
+enum {
+  MPC_TYPE_UNDEFINED = 0,
+  MPC_TYPE_PASS      = 1,
+  MPC_TYPE_FAIL      = 2,
+  MPC_TYPE_LIFT      = 3,
+  MPC_TYPE_LIFT_VAL  = 4,
+  MPC_TYPE_EXPECT    = 5,
+  MPC_TYPE_ANCHOR    = 6,
+  MPC_TYPE_STATE     = 7,
+  
+  MPC_TYPE_ANY       = 8,
+  MPC_TYPE_SINGLE    = 9,
+  MPC_TYPE_ONEOF     = 10,
+  MPC_TYPE_NONEOF    = 11,
+  MPC_TYPE_RANGE     = 12,
+  MPC_TYPE_SATISFY   = 13,
+  MPC_TYPE_STRING    = 14,
+  
+  MPC_TYPE_APPLY     = 15,
+  MPC_TYPE_APPLY_TO  = 16,
+  MPC_TYPE_PREDICT   = 17,
+  MPC_TYPE_NOT       = 18,
+  MPC_TYPE_MAYBE     = 19,
+  MPC_TYPE_MANY      = 20,
+  MPC_TYPE_MANY1     = 21,
+  MPC_TYPE_COUNT     = 22,
+  
+  MPC_TYPE_OR        = 23,
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_SPAN      = 25,
+  MPC_TYPE_MANY_ACC  = 26,
+  MPC_TYPE_MANY1_ACC = 27,
+  MPC_TYPE_MEMO      = 28
+};
+
+/*
+** The body of a span builds no values, so where it
+** can be it is also compiled to a flat program for a
+** small backtracking machine. `x` is a jump target,
+** or the character of a `CHAR` or the length of a
+** `STRING`. `CHOICE` saves a place to go back to if
+** what follows fails, and `COMMIT` drops it again.
+**
+** Only span bodies are compiled. There are no calls
+** or returns, as a span body refers to no rules, and
+** everything that builds values, including every
+** rule, still runs on the parsing loop's stack.
+*/
+
+enum {
+  MPC_OP_END            = 0,
+  MPC_OP_ANY            = 1,
+  MPC_OP_CHAR           = 2,
+  MPC_OP_SET            = 3,
+  MPC_OP_SPAN           = 4,
+  MPC_OP_STRING         = 5,
+  MPC_OP_SATISFY        = 6,
+  MPC_OP_ANCHOR         = 7,
+  MPC_OP_CHOICE         = 8,
+  MPC_OP_COMMIT         = 9,
+  MPC_OP_PARTIAL_COMMIT = 10,
+  MPC_OP_FAIL           = 11,
+  MPC_OP_FAIL_TWICE     = 12
+};
+
+typedef union {
+  const char *s;
+  unsigned char *set;
+  int(*satisfy)(char);
+  int(*anchor)(char,char);
+} mpc_idata_t;
+
+typedef struct {
+  int op;
+  int x;
+  mpc_idata_t data;
+} mpc_inst_t;
+
+typedef struct { char *m; } mpc_pdata_fail_t;
+typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
+typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
+typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
+typedef struct { char x; } mpc_pdata_single_t;
+typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
+typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
+typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
+typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_inst_t *prog; } mpc_pdata_span_t;
+typedef struct { mpc_acc_t f; mpc_ctor_t lf; mpc_parser_t *x; } mpc_pdata_acc_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t copy; mpc_dtor_t dx; } mpc_pdata_memo_t;
+
+typedef union {
+  mpc_pdata_fail_t fail;
+  mpc_pdata_lift_t lift;
+  mpc_pdata_expect_t expect;
+  mpc_pdata_anchor_t anchor;
+  mpc_pdata_single_t single;
+  mpc_pdata_range_t range;
+  mpc_pdata_satisfy_t satisfy;
+  mpc_pdata_string_t string;
+  mpc_pdata_apply_t apply;
+  mpc_pdata_apply_to_t apply_to;
+  mpc_pdata_predict_t predict;
+  mpc_pdata_not_t not;
+  mpc_pdata_repeat_t repeat;
+  mpc_pdata_and_t and;
+  mpc_pdata_or_t or;
+  mpc_pdata_span_t span;
+  mpc_pdata_acc_t acc;
+  mpc_pdata_memo_t memo;
+} mpc_pdata_t;
+
+struct mpc_parser_t {
+  char retained;
+  char *name;
+  char type;
+  int id;
+  mpc_pdata_t data;
+};
+
+int mpc_soi_anchor(char prev, char next);
+int mpc_eoi_anchor(char prev, char next);
+int mpc_boundary_anchor(char prev, char next);
+
+mpc_val_t *mpcaf_str_ast_string(mpc_val_t *c);
+mpc_val_t *mpcaf_str_ast_char(mpc_val_t *c);
+mpc_val_t *mpcaf_str_ast_regex(mpc_val_t *c);
+mpc_val_t *mpcaf_grammar_add_rule(mpc_val_t *x, void *p);
+
+#endif
 
 #endif
@@ -0,0 +1,503 @@
+// Parser Tests and Benchmarks
+//
+// Checks and timings for the mpc parser that are not part of the interpreter.
+// They only need mpc, so build them on their own:
+//
+//     cc -std=c99 -O2 parse_bench.c mpc.c -lm -lpthread -o parse_bench
+//
+// then run one of
+//
+//     ./parse_bench --stress-parse=threads file ...
+//     ./parse_bench --packrat-bench=n
+//     ./parse_bench --vm-bench=kilobytes
+//     ./parse_bench --large-file
+
+// Ask for the POSIX functions (clock_gettime, open_memstream, sysconf, fseeko)
+// on top of C99.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mpc.h"
+#include "grammar.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Wall clock time in seconds, from an arbitrary starting point.
+
+double clock_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// The Lispy grammar, built from the same definition as in variables.c.
+
+mpc_parser_t* Number;
+mpc_parser_t* Symbol;
+mpc_parser_t* String;
+mpc_parser_t* Sexpr;
+mpc_parser_t* Qexpr;
+mpc_parser_t* Expr;
+mpc_parser_t* Lispy;
+
+void lispy_grammar_new(void) {
+    Number = mpc_new("number");
+    Symbol = mpc_new("symbol");
+    String = mpc_new("string");
+    Sexpr = mpc_new("sexpr");
+    Qexpr = mpc_new("qexpr");
+    Expr = mpc_new("expr");
+    Lispy = mpc_new("lispy");
+    mpca_lang(MPCA_LANG_DEFAULT, LISPY_GRAMMAR,
+            Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+}
+
+void lispy_grammar_delete(void) {
+    mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+}
+
+// Parse Stress Test
+//
+// A parser may be shared by any number of threads once it is built, since a
+// parse only reads it. --stress-parse=N checks this by parsing the given files
+// with the one Lispy parser on N threads at once, each thread with its own
+// copy of every file, and compares every result with what a single thread
+// produced. It reports the throughput against one thread doing the same work.
+
+#define STRESS_ROUNDS 4
+
+typedef struct {
+    char** texts;
+    char** expected;
+    int texts_num;
+    long bytes;
+    int mismatches;
+} stress_job;
+
+// Print the AST of a parse with its positions, or the error, into a new string
+// for comparing results, and delete it.
+
+char* result_string(int ok, mpc_result_t* r) {
+    char* printed;
+    size_t length;
+    FILE* f = open_memstream(&printed, &length);
+
+    if (ok) {
+        mpc_ast_print_to(r->output, f);
+        mpc_ast_delete(r->output);
+    } else {
+        char* error = mpc_err_string(r->error);
+        fputs(error, f);
+        free(error);
+        mpc_err_delete(r->error);
+    }
+
+    fclose(f);
+    return printed;
+}
+
+char* stress_parse_text(const char* text) {
+    mpc_result_t r;
+    return result_string(mpc_parse("<stress>", text, Lispy, &r), &r);
+}
+
+void* stress_thread(void* arg) {
+    stress_job* j = arg;
+
+    for (int r = 0; r < STRESS_ROUNDS; r++) {
+        for (int k = 0; k < j->texts_num; k++) {
+            char* printed = stress_parse_text(j->texts[k]);
+
+            if (strcmp(printed, j->expected[k]) != 0) {
+                j->mismatches++;
+            }
+
+            j->bytes += strlen(j->texts[k]);
+            free(printed);
+        }
+    }
+
+    return NULL;
+}
+
+// Parse the files on the given number of threads, returning the bytes parsed
+// per second by all of them together.
+
+double stress_run(char** texts, char** expected, int texts_num, int threads_num, int* mismatches) {
+    pthread_t* threads = malloc(sizeof(pthread_t) * threads_num);
+    stress_job* jobs = malloc(sizeof(stress_job) * threads_num);
+
+    for (int t = 0; t < threads_num; t++) {
+        jobs[t].texts = malloc(sizeof(char*) * texts_num);
+
+        for (int k = 0; k < texts_num; k++) {
+            jobs[t].texts[k] = malloc(strlen(texts[k]) + 1);
+            strcpy(jobs[t].texts[k], texts[k]);
+        }
+
+        jobs[t].expected = expected;
+        jobs[t].texts_num = texts_num;
+        jobs[t].bytes = 0;
+        jobs[t].mismatches = 0;
+    }
+
+    double start = clock_seconds();
+
+    for (int t = 0; t < threads_num; t++) {
+        pthread_create(&threads[t], NULL, stress_thread, &jobs[t]);
+    }
+
+    long bytes = 0;
+
+    for (int t = 0; t < threads_num; t++) {
+        pthread_join(threads[t], NULL);
+        bytes += jobs[t].bytes;
+        *mismatches += jobs[t].mismatches;
+
+        for (int k = 0; k < texts_num; k++) {
+            free(jobs[t].texts[k]);
+        }
+
+        free(jobs[t].texts);
+    }
+
+    double seconds = clock_seconds() - start;
+
+    free(jobs);
+    free(threads);
+    return bytes / seconds;
+}
+
+// Read a whole file into a new string, or return NULL if it cannot be read.
+
+char* stress_read_file(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* text = malloc(length + 1);
+    length = fread(text, 1, length, f);
+    text[length] = '\0';
+
+    fclose(f);
+    return text;
+}
+
+int stress_parse(char** files, int files_num, int threads_num) {
+    if (files_num == 0 || threads_num < 1) {
+        fprintf(stderr, "--stress-parse needs a number of threads and some files.\n");
+        return 0;
+    }
+
+    lispy_grammar_new();
+
+    char** texts = malloc(sizeof(char*) * files_num);
+    char** expected = malloc(sizeof(char*) * files_num);
+    int loaded = 0;
+
+    for (; loaded < files_num; loaded++) {
+        texts[loaded] = stress_read_file(files[loaded]);
+
+        if (texts[loaded] == NULL) {
+            fprintf(stderr, "Could not open file '%s'.\n", files[loaded]);
+            break;
+        }
+
+        expected[loaded] = stress_parse_text(texts[loaded]);
+    }
+
+    int ok = loaded == files_num;
+
+    if (ok) {
+        int mismatches = 0;
+        double one = stress_run(texts, expected, files_num, 1, &mismatches);
+        double many = stress_run(texts, expected, files_num, threads_num, &mismatches);
+
+        printf("1 thread: %.2f MB/s\n", one / 1e6);
+        printf("%d threads: %.2f MB/s (%.2fx)\n", threads_num, many / 1e6, many / one);
+        printf("%d results differed from a single-threaded parse.\n", mismatches);
+
+        ok = mismatches == 0;
+    }
+
+    for (int k = 0; k < loaded; k++) {
+        free(texts[k]);
+        free(expected[k]);
+    }
+
+    free(texts);
+    free(expected);
+    lispy_grammar_delete();
+    return ok;
+}
+
+// Packrat Benchmark
+//
+// A grammar whose alternatives share a long prefix makes a backtracking parser
+// read that prefix again for every alternative it tries. In
+//
+//     s : 'a' <s> 'b' | 'a' <s> 'c' | 'a' ;
+//
+// the second alternative parses <s> again at the same place the first one
+// did, so reading n 'a's followed by n-1 'c's takes on the order of 2^n steps.
+// With MPCA_LANG_PACKRAT each rule remembers its result at every position, and
+// the second attempt is a lookup. --packrat-bench=N times both for inputs of
+// up to N 'a's.
+
+#define PACKRAT_STEP 4
+
+// Time one parse of the input with the grammar built with the given flags,
+// returning the seconds taken and filling in the count of memo hits.
+
+double packrat_time(int flags, const char* input, long* hits) {
+    mpc_parser_t* S = mpc_new("s");
+    mpca_lang(flags, "s : 'a' <s> 'b' | 'a' <s> 'c' | 'a' ;", S, NULL);
+
+    mpc_result_t r;
+    mpc_stats_t stats;
+    double start = clock_seconds();
+    int ok = mpc_parse_stats("<packrat>", input, strlen(input), S, &r, &stats);
+    double seconds = clock_seconds() - start;
+
+    if (ok) {
+        mpc_ast_delete(r.output);
+    } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+    }
+
+    *hits = stats.memo_hits;
+    mpc_cleanup(1, S);
+    return seconds;
+}
+
+int packrat_bench(int n_max) {
+    if (n_max < PACKRAT_STEP) {
+        fprintf(stderr, "--packrat-bench needs a size of at least %d.\n", PACKRAT_STEP);
+        return 0;
+    }
+
+    char* input = malloc(2 * n_max);
+
+    for (int n = PACKRAT_STEP; n <= n_max; n += PACKRAT_STEP) {
+        memset(input, 'a', n);
+        memset(input + n, 'c', n - 1);
+        input[2 * n - 1] = '\0';
+
+        long hits;
+        double plain = packrat_time(MPCA_LANG_WHITESPACE_SENSITIVE, input, &hits);
+        double packrat = packrat_time(MPCA_LANG_WHITESPACE_SENSITIVE | MPCA_LANG_PACKRAT, input, &hits);
+
+        printf("n = %3d: %10.4fs backtracking, %8.4fs packrat (%ld memo hits)\n",
+               n, plain, packrat, hits);
+    }
+
+    free(input);
+    return 1;
+}
+
+// Span Program Benchmark
+//
+// The body of every span, which includes every regex and the whitespace that
+// mpca_lang skips after each token, is compiled to a small program that runs
+// in place of the parsers it was built from. --vm-bench=KB generates that much
+// Lispy source, parses it with mpc_parse_n, which runs the programs, and with
+// mpc_parse_interpreted, which does not, checks that both give the same AST,
+// and reports the throughput of each.
+
+#define VM_ROUNDS 5
+
+// Append a random Lispy expression to the stream, nesting no deeper than the
+// given depth.
+
+void vm_gen_expr(FILE* f, int depth) {
+    static const char* symbols[] = {
+        "def", "=", "+", "-", "*", "/", "head", "tail", "join", "eval",
+        "list", "if", "==", "<=", "fun", "unpack", "curry", "load"
+    };
+
+    int kind = rand() % (depth > 0 ? 5 : 3);
+
+    switch (kind) {
+        case 0:
+            fprintf(f, "%d", rand() % 200000 - 100000);
+            break;
+        case 1:
+            fputs(symbols[rand() % (sizeof(symbols) / sizeof(symbols[0]))], f);
+            if (rand() % 2) { fprintf(f, "_%d", rand() % 1000); }
+            break;
+        case 2:
+            fprintf(f, "\"text %d\\n\"", rand() % 1000);
+            break;
+        default: {
+            int items = rand() % 6;
+            fputc(kind == 3 ? '(' : '{', f);
+
+            for (int k = 0; k < items; k++) {
+                if (k > 0) { fputs(rand() % 8 ? " " : "\n    ", f); }
+                vm_gen_expr(f, depth - 1);
+            }
+
+            fputc(kind == 3 ? ')' : '}', f);
+        }
+    }
+}
+
+char* vm_gen_source(long bytes) {
+    char* text;
+    size_t length;
+    FILE* f = open_memstream(&text, &length);
+
+    while (ftell(f) < bytes) {
+        fputs("(def {", f);
+        vm_gen_expr(f, 0);
+        fputs("} ", f);
+        vm_gen_expr(f, 4);
+        fputs(")\n", f);
+    }
+
+    fclose(f);
+    return text;
+}
+
+// Parse a text with or without the span programs, printing the result into a
+// new string and adding the seconds taken to the total.
+
+char* vm_parse_text(const char* text, int interpreted, double* seconds) {
+    mpc_result_t r;
+    double start = clock_seconds();
+    int ok = interpreted
+        ? mpc_parse_interpreted("<vm>", text, strlen(text), Lispy, &r)
+        : mpc_parse_n("<vm>", text, strlen(text), Lispy, &r);
+    *seconds += clock_seconds() - start;
+
+    return result_string(ok, &r);
+}
+
+int vm_bench(long kilobytes) {
+    if (kilobytes < 1) {
+        fprintf(stderr, "--vm-bench needs a size of at least 1 kilobyte.\n");
+        return 0;
+    }
+
+    lispy_grammar_new();
+    srand(1);
+
+    char* text = vm_gen_source(kilobytes * 1024);
+    double compiled = 0;
+    double interpreted = 0;
+    int mismatches = 0;
+
+    for (int r = 0; r < VM_ROUNDS; r++) {
+        char* a = vm_parse_text(text, 0, &compiled);
+        char* b = vm_parse_text(text, 1, &interpreted);
+
+        if (strcmp(a, b) != 0) {
+            mismatches++;
+        }
+
+        free(a);
+        free(b);
+    }
+
+    double megabytes = (double)strlen(text) * VM_ROUNDS / 1e6;
+    printf("span programs: %.2f MB/s\n", megabytes / compiled);
+    printf("interpreted:   %.2f MB/s (%.2fx)\n", megabytes / interpreted, interpreted / compiled);
+    printf("%d of %d parses differed.\n", mismatches, VM_ROUNDS);
+
+    free(text);
+    lispy_grammar_delete();
+    return mismatches == 0;
+}
+
+// Large File Test
+//
+// A File is parsed from wherever it is, and positions are counted from there.
+// --large-file writes some Lispy source, one good and one broken, past 4 GB
+// into a sparse temporary file, seeks there, and checks that parsing the File
+// gives the same AST or error, positions included, as parsing the same text
+// from a string. An offset cut to 32 bits anywhere on the way reads the zeros
+// at the start of the file instead.
+
+#define LARGE_OFFSET ((off_t)5 << 30)
+
+int large_file_check(const char* text) {
+    FILE* f = tmpfile();
+
+    if (f == NULL || fseeko(f, LARGE_OFFSET, SEEK_SET) != 0) {
+        fprintf(stderr, "Could not make a temporary file past 4 GB.\n");
+        if (f) { fclose(f); }
+        return 0;
+    }
+
+    fputs(text, f);
+    fflush(f);
+    fseeko(f, LARGE_OFFSET, SEEK_SET);
+
+    mpc_result_t r;
+    int ok = mpc_parse_file("<large>", f, Lispy, &r);
+    char* printed = result_string(ok, &r);
+    char* expected = result_string(mpc_parse("<large>", text, Lispy, &r), &r);
+
+    fclose(f);
+
+    int same = strcmp(printed, expected) == 0;
+    printf("%s at %lld: %s\n", ok ? "parsed" : "failed", (long long)LARGE_OFFSET,
+           same ? "same as from a string" : "DIFFERENT from a string");
+
+    free(printed);
+    free(expected);
+    return same;
+}
+
+int large_file(void) {
+    lispy_grammar_new();
+
+    int ok = large_file_check("(def {x} 10)\n(+ x\n   \"two\" {1 2})\n")
+        & large_file_check("(def {x} 10)\n(+ x\n   \"two {1 2})\n");
+
+    lispy_grammar_delete();
+    return ok;
+}
+
+// Main
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && strncmp(argv[1], "--stress-parse=", 15) == 0) {
+        // Zero threads means one for each core.
+
+        int threads = atoi(argv[1] + 15);
+
+        if (threads == 0) {
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+
+        return stress_parse(argv + 2, argc - 2, threads) ? 0 : 1;
+    }
+
+    if (argc == 2 && strncmp(argv[1], "--packrat-bench=", 16) == 0) {
+        return packrat_bench(atoi(argv[1] + 16)) ? 0 : 1;
+    }
+
+    if (argc == 2 && strncmp(argv[1], "--vm-bench=", 11) == 0) {
+        return vm_bench(atol(argv[1] + 11)) ? 0 : 1;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--large-file") == 0) {
+        return large_file() ? 0 : 1;
+    }
+
+    fprintf(stderr, "Usage: %s --stress-parse=threads file ...\n"
+            "       %s --packrat-bench=n\n"
+            "       %s --vm-bench=kilobytes\n"
+            "       %s --large-file\n", argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
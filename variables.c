@@ -1,8 +1,18 @@
+// Ask for the POSIX functions (isatty, fileno, clock_gettime) on top of C99.
+
+#define _POSIX_C_SOURCE 200809L
+
 #include "mpc.h"
+#include "grammar.h"
+
+#include <limits.h>
+#include <time.h>
 
 #ifdef _WIN32
 // If compiling on Windows, define the following (fake) functions.
 
+#include <io.h>
+
 // Declaring the input buffer static means that it is local to this file.
 static char buffer[2048];
 
@@ -22,8 +32,34 @@ void add_history(char* unused) {}
 
 #include <editline/readline.h>
 #include <editline/history.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+// Whether standard input is a terminal someone is typing at.
+
+int stdin_is_terminal(void) {
+#ifdef _WIN32
+    return _isatty(_fileno(stdin));
+#else
+    return isatty(fileno(stdin));
+#endif
+}
 
+// Wall clock time in seconds, from an arbitrary starting point.
+
+double clock_seconds(void) {
+#ifdef _WIN32
+    return (double) clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
 #endif
+}
 
 // Forward Declarations
 
@@ -34,7 +70,7 @@ typedef struct lenv lenv;
 
 // Lisp Value
 
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
@@ -44,15 +80,22 @@ struct lval {
     long number;
     char* error;
     char* symbol;
+    char* string;
     lbuiltin function;
 
     int count;
     lval** cell;
+
+    // Number of owners of a hash-consed node, or 0 for an ordinary node that
+    // is owned by exactly one parent.
+
+    int refs;
 };
 
 lval* lval_num(long x) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_NUM;
+    v->refs = 0;
     v->number = x;
     return v;
 }
@@ -60,6 +103,7 @@ lval* lval_num(long x) {
 lval* lval_err(char* fmt, ...) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_ERR;
+    v->refs = 0;
 
     // Create a va list and initialize it.
     
@@ -88,14 +132,25 @@ lval* lval_err(char* fmt, ...) {
 lval* lval_sym(char* s) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_SYM;
+    v->refs = 0;
     v->symbol = malloc(strlen(s) + 1);
     strcpy(v->symbol, s);
     return v;
 }
 
+lval* lval_str(char* s) {
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_STR;
+    v->refs = 0;
+    v->string = malloc(strlen(s) + 1);
+    strcpy(v->string, s);
+    return v;
+}
+
 lval* lval_fun(lbuiltin func) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_FUN;
+    v->refs = 0;
     v->function = func;
     return v;
 }
@@ -103,6 +158,7 @@ lval* lval_fun(lbuiltin func) {
 lval* lval_sexpr(void) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_SEXPR;
+    v->refs = 0;
     v->count = 0;
     v->cell = NULL;
     return v;
@@ -111,12 +167,29 @@ lval* lval_sexpr(void) {
 lval* lval_qexpr(void) {
     lval* v = malloc(sizeof(lval));
     v->type = LVAL_QEXPR;
+    v->refs = 0;
     v->count = 0;
     v->cell = NULL;
     return v;
 }
 
+void lval_release(lval* v);
+int image_contains(void* p);
+
 void lval_del(lval* v) {
+    // Nodes inside a loaded image live as long as the image does.
+
+    if (image_contains(v)) {
+        return;
+    }
+
+    // Hash-consed nodes are shared, so only drop this owner's reference.
+
+    if (v->refs) {
+        lval_release(v);
+        return;
+    }
+
     switch (v->type) {
         case LVAL_NUM:
         case LVAL_FUN:
@@ -127,6 +200,9 @@ void lval_del(lval* v) {
         case LVAL_SYM:
             free(v->symbol);
             break;
+        case LVAL_STR:
+            free(v->string);
+            break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             // Delete all the elements inside.
@@ -150,6 +226,7 @@ void lval_del(lval* v) {
 lval* lval_copy(lval* v) {
     lval* x = malloc(sizeof(lval));
     x->type = v->type; // Found it!
+    x->refs = 0;
 
     switch (v->type) {
         case LVAL_FUN:
@@ -166,6 +243,10 @@ lval* lval_copy(lval* v) {
             x->symbol = malloc(strlen(v->symbol) + 1);
             strcpy(x->symbol, v->symbol);
             break;
+        case LVAL_STR:
+            x->string = malloc(strlen(v->string) + 1);
+            strcpy(x->string, v->string);
+            break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
@@ -220,50 +301,551 @@ lval* lval_take(lval* v, int i) {
     return x;
 }
 
-void lval_print(lval* v);
+// Structural hashing and equality, used wherever two lval trees need to be
+// compared by value rather than by pointer.
+
+unsigned long lval_hash(lval* v) {
+    unsigned long h = 2166136261UL ^ (unsigned long) v->type;
+
+    switch (v->type) {
+        case LVAL_FUN:
+            h = h * 16777619UL ^ (unsigned long) (size_t) v->function;
+            break;
+        case LVAL_NUM:
+            h = h * 16777619UL ^ (unsigned long) v->number;
+            break;
+        case LVAL_ERR:
+            for (char* c = v->error; *c; c++) {
+                h = h * 16777619UL ^ (unsigned char) *c;
+            }
+            break;
+        case LVAL_SYM:
+            for (char* c = v->symbol; *c; c++) {
+                h = h * 16777619UL ^ (unsigned char) *c;
+            }
+            break;
+        case LVAL_STR:
+            for (char* c = v->string; *c; c++) {
+                h = h * 16777619UL ^ (unsigned char) *c;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) {
+                h = h * 31 + lval_hash(v->cell[i]);
+            }
+            h ^= (unsigned long) v->count;
+            break;
+    }
+
+    return h;
+}
+
+int lval_eq(lval* x, lval* y) {
+    if (x == y) {
+        return 1;
+    }
+
+    // Equal hash-consed nodes are always the same node.
+
+    if (x->refs && y->refs) {
+        return 0;
+    }
+
+    if (x->type != y->type) {
+        return 0;
+    }
+
+    switch (x->type) {
+        case LVAL_FUN:
+            return x->function == y->function;
+        case LVAL_NUM:
+            return x->number == y->number;
+        case LVAL_ERR:
+            return strcmp(x->error, y->error) == 0;
+        case LVAL_SYM:
+            return strcmp(x->symbol, y->symbol) == 0;
+        case LVAL_STR:
+            return strcmp(x->string, y->string) == 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (x->count != y->count) {
+                return 0;
+            }
+
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) {
+                    return 0;
+                }
+            }
+
+            return 1;
+    }
+
+    return 0;
+}
+
+// Hash-Consing
+//
+// When enabled with `hashcons 1`, values stored in the environment are
+// canonicalized through a table so that structurally equal sub-trees share a
+// single node. Children are canonicalized before their parent, so two lists
+// are equal exactly when their cell pointers are, and a node can be looked up
+// with a shallow hash of its children's addresses.
+//
+// The table does not own its nodes: each node counts its owners in refs, and
+// it is removed from the table when the last owner releases it. Shared nodes
+// are never handed to the evaluator, which mutates lists in place; lenv_get
+// still returns a private lval_copy.
+
+struct {
+    int enabled;
+    int count;
+    int size;
+    lval** nodes;
+} hashcons;
+
+unsigned long lval_hash_shallow(lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        return lval_hash(v);
+    }
 
-void lval_print_expr(lval* v, char open, char close) {
-    putchar(open);
+    unsigned long h = 2166136261UL ^ (unsigned long) v->type;
 
     for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
+        h = h * 31 + (unsigned long) (size_t) v->cell[i];
+    }
+
+    return h ^ (unsigned long) v->count;
+}
+
+int lval_eq_shallow(lval* x, lval* y) {
+    if (x->type != y->type) {
+        return 0;
+    }
+
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) {
+        return lval_eq(x, y);
+    }
 
-        // Don't print the trailing space if this is the last element.
+    if (x->count != y->count) {
+        return 0;
+    }
 
-        if (i != (v->count - 1)) {
-            putchar(' ');
+    for (int i = 0; i < x->count; i++) {
+        if (x->cell[i] != y->cell[i]) {
+            return 0;
         }
     }
 
-    putchar(close);
+    return 1;
 }
 
-void lval_print(lval* v) {
+// The table uses open addressing with linear probing. Returns the slot holding
+// a node equal to v, or the empty slot where it belongs.
+
+lval** hashcons_slot(lval* v) {
+    int i = lval_hash_shallow(v) % hashcons.size;
+
+    while (hashcons.nodes[i] && !lval_eq_shallow(hashcons.nodes[i], v)) {
+        i = (i + 1) % hashcons.size;
+    }
+
+    return &hashcons.nodes[i];
+}
+
+void hashcons_grow(void) {
+    lval** old = hashcons.nodes;
+    int old_size = hashcons.size;
+
+    hashcons.size = old_size ? old_size * 2 : 1024;
+    hashcons.nodes = calloc(hashcons.size, sizeof(lval*));
+
+    for (int i = 0; i < old_size; i++) {
+        if (old[i]) {
+            *hashcons_slot(old[i]) = old[i];
+        }
+    }
+
+    free(old);
+}
+
+void hashcons_remove(lval* v) {
+    lval** slot = hashcons_slot(v);
+    *slot = NULL;
+    hashcons.count--;
+
+    // Re-insert the rest of the probe run so later lookups don't stop early.
+
+    int i = (slot - hashcons.nodes + 1) % hashcons.size;
+
+    while (hashcons.nodes[i]) {
+        lval* x = hashcons.nodes[i];
+        hashcons.nodes[i] = NULL;
+        *hashcons_slot(x) = x;
+        i = (i + 1) % hashcons.size;
+    }
+}
+
+// Return the canonical node for v, whose children are replaced by the
+// canonical nodes in cells, taking a new reference to it. The references held
+// in cells pass to the node. v itself is left untouched.
+
+lval* hashcons_node(lval* v, lval** cells) {
+    if ((hashcons.count + 1) * 2 > hashcons.size) {
+        hashcons_grow();
+    }
+
+    lval key = *v;
+
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        key.cell = cells;
+    }
+
+    lval** slot = hashcons_slot(&key);
+
+    if (*slot) {
+        // An equal node already holds references to these same children.
+
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            for (int i = 0; i < v->count; i++) {
+                lval_release(cells[i]);
+            }
+        }
+
+        (*slot)->refs++;
+        return *slot;
+    }
+
+    lval* x = malloc(sizeof(lval));
+    *x = key;
+    x->refs = 1;
+
+    switch (x->type) {
+        case LVAL_ERR:
+            x->error = malloc(strlen(v->error) + 1);
+            strcpy(x->error, v->error);
+            break;
+        case LVAL_SYM:
+            x->symbol = malloc(strlen(v->symbol) + 1);
+            strcpy(x->symbol, v->symbol);
+            break;
+        case LVAL_STR:
+            x->string = malloc(strlen(v->string) + 1);
+            strcpy(x->string, v->string);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            x->cell = malloc(sizeof(lval*) * x->count);
+            if (x->count > 0) {
+                memcpy(x->cell, cells, sizeof(lval*) * x->count);
+            }
+            break;
+    }
+
+    *slot = x;
+    hashcons.count++;
+    return x;
+}
+
+// Return a canonical shared node equal to v, taking a new reference to it. v
+// itself is left untouched.
+//
+// Children are canonicalized before their parent. Lists are walked with an
+// explicit stack, as when printing, and the canonical children of every open
+// list are collected in one heap buffer, so a long or deeply nested list
+// cannot overflow the C stack.
+
+typedef struct {
+    lval* list;
+    int i;
+    int base;
+} intern_frame;
+
+lval* lval_intern(lval* v) {
+    intern_frame* stack = NULL;
+    int slots = 0;
+    int depth = 0;
+
+    lval** cells = NULL;
+    int cells_num = 0;
+    int cells_slots = 0;
+
+    lval* x;
+
+    while (1) {
+        if (v->refs == 0 && (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count > 0) {
+            if (depth == slots) {
+                slots = slots ? slots * 2 : 32;
+                stack = realloc(stack, sizeof(intern_frame) * slots);
+            }
+
+            while (cells_num + v->count > cells_slots) {
+                cells_slots = cells_slots ? cells_slots * 2 : 256;
+                cells = realloc(cells, sizeof(lval*) * cells_slots);
+            }
+
+            stack[depth].list = v;
+            stack[depth].i = 0;
+            stack[depth].base = cells_num;
+            cells_num += v->count;
+            depth++;
+            v = v->cell[0];
+            continue;
+        }
+
+        if (v->refs) {
+            v->refs++;
+            x = v;
+        } else {
+            x = hashcons_node(v, NULL);
+        }
+
+        // The node is canonical, so hand it to its list and move on to the
+        // next item, completing every list that has run out on the way.
+
+        while (depth > 0) {
+            intern_frame* f = &stack[depth - 1];
+            cells[f->base + f->i] = x;
+
+            if (++f->i < f->list->count) {
+                v = f->list->cell[f->i];
+                break;
+            }
+
+            x = hashcons_node(f->list, cells + f->base);
+            cells_num = f->base;
+            depth--;
+        }
+
+        if (depth == 0) {
+            break;
+        }
+    }
+
+    free(stack);
+    free(cells);
+    return x;
+}
+
+void lval_release(lval* v) {
+    if (--v->refs > 0) {
+        return;
+    }
+
+    hashcons_remove(v);
+
+    // The node is no longer shared, so delete it like an ordinary one.
+
+    lval_del(v);
+}
+
+// Count the nodes reachable from v as if no sub-tree were shared.
+
+long lval_size(lval* v) {
+    long n = 1;
+
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i = 0; i < v->count; i++) {
+            n += lval_size(v->cell[i]);
+        }
+    }
+
+    return n;
+}
+
+// Printing
+//
+// Values are written into an lbuf, a growable byte buffer, rather than through
+// printf and putchar one piece at a time. Numbers are formatted by hand, and
+// lists are walked with an explicit stack instead of by recursion, so printing
+// a deeply nested list cannot overflow the C stack. A buffer with a file set
+// writes itself out in large chunks as it fills instead of growing.
+
+#define LBUF_FLUSH 65536
+
+typedef struct {
+    char* data;
+    int length;
+    int capacity;
+    FILE* file;
+} lbuf;
+
+void lbuf_flush(lbuf* b) {
+    if (b->file && b->length > 0) {
+        fwrite(b->data, 1, b->length, b->file);
+        b->length = 0;
+    }
+}
+
+void lbuf_reserve(lbuf* b, int n) {
+    if (b->length + n <= b->capacity) {
+        return;
+    }
+
+    while (b->length + n > b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 256;
+    }
+
+    b->data = realloc(b->data, b->capacity);
+}
+
+void lbuf_putc(lbuf* b, char c) {
+    lbuf_reserve(b, 1);
+    b->data[b->length++] = c;
+}
+
+void lbuf_write(lbuf* b, const char* s, int n) {
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->length, s, n);
+    b->length += n;
+}
+
+void lbuf_puts(lbuf* b, const char* s) {
+    lbuf_write(b, s, strlen(s));
+}
+
+void lbuf_put_long(lbuf* b, long x) {
+    // Work on the magnitude as unsigned so that LONG_MIN can be negated, and
+    // fill in the digits from the end of a scratch buffer.
+
+    char digits[24];
+    char* c = digits + sizeof(digits);
+    unsigned long n = x < 0 ? -(unsigned long) x : (unsigned long) x;
+
+    do {
+        *--c = '0' + n % 10;
+        n /= 10;
+    } while (n);
+
+    if (x < 0) {
+        *--c = '-';
+    }
+
+    lbuf_write(b, c, digits + sizeof(digits) - c);
+}
+
+void lbuf_put_str(lbuf* b, lval* v) {
+    // Write the string with its special characters escaped again.
+
+    char* escaped = malloc(strlen(v->string) + 1);
+    strcpy(escaped, v->string);
+    escaped = mpcf_escape(escaped);
+
+    lbuf_putc(b, '"');
+    lbuf_puts(b, escaped);
+    lbuf_putc(b, '"');
+
+    free(escaped);
+}
+
+void lbuf_put_atom(lbuf* b, lval* v) {
     switch (v->type) {
         case LVAL_FUN:
-            printf("<function>");
+            lbuf_puts(b, "<function>");
             break;
         case LVAL_NUM:
-            printf("%li", v->number);
+            lbuf_put_long(b, v->number);
             break;
         case LVAL_ERR:
-            printf("Error: %s", v->error);
+            lbuf_puts(b, "Error: ");
+            lbuf_puts(b, v->error);
             break;
         case LVAL_SYM:
-            printf("%s", v->symbol);
+            lbuf_puts(b, v->symbol);
             break;
-        case LVAL_SEXPR:
-            lval_print_expr(v, '(', ')');
+        case LVAL_STR:
+            lbuf_put_str(b, v);
             break;
-        case LVAL_QEXPR:
-            lval_print_expr(v, '{', '}');
+    }
+}
+
+// A list being written, and the index of the item being written inside it.
+
+typedef struct {
+    lval* list;
+    int i;
+} lbuf_frame;
+
+void lbuf_put_lval(lbuf* b, lval* v) {
+    lbuf_frame local[32];
+    lbuf_frame* stack = local;
+    int slots = 32;
+    int depth = 0;
+
+    while (1) {
+        if (b->length >= LBUF_FLUSH) {
+            lbuf_flush(b);
+        }
+
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+            lbuf_putc(b, v->type == LVAL_SEXPR ? '(' : '{');
+
+            if (v->count > 0) {
+                if (depth == slots) {
+                    slots *= 2;
+
+                    if (stack == local) {
+                        stack = malloc(sizeof(lbuf_frame) * slots);
+                        memcpy(stack, local, sizeof(local));
+                    } else {
+                        stack = realloc(stack, sizeof(lbuf_frame) * slots);
+                    }
+                }
+
+                stack[depth].list = v;
+                stack[depth].i = 0;
+                depth++;
+                v = v->cell[0];
+                continue;
+            }
+
+            lbuf_putc(b, v->type == LVAL_SEXPR ? ')' : '}');
+        } else {
+            lbuf_put_atom(b, v);
+        }
+
+        // The value is complete, so move on to the next item, closing every
+        // list that has run out of items on the way.
+
+        while (depth > 0) {
+            lbuf_frame* f = &stack[depth - 1];
+
+            if (++f->i < f->list->count) {
+                lbuf_putc(b, ' ');
+                v = f->list->cell[f->i];
+                break;
+            }
+
+            lbuf_putc(b, f->list->type == LVAL_SEXPR ? ')' : '}');
+            depth--;
+        }
+
+        if (depth == 0) {
             break;
+        }
+    }
+
+    if (stack != local) {
+        free(stack);
     }
 }
 
+// The buffer lval_print writes through to stdout.
+
+lbuf print_buffer = { NULL, 0, 0, NULL };
+
+void lval_print(lval* v) {
+    print_buffer.file = stdout;
+    lbuf_put_lval(&print_buffer, v);
+    lbuf_flush(&print_buffer);
+}
+
 void lval_println(lval* v) {
-    lval_print(v);
-    putchar('\n');
+    print_buffer.file = stdout;
+    lbuf_put_lval(&print_buffer, v);
+    lbuf_putc(&print_buffer, '\n');
+    lbuf_flush(&print_buffer);
 }
 
 char* ltype_name(int t) {
@@ -276,6 +858,8 @@ char* ltype_name(int t) {
             return "Error";
         case LVAL_SYM:
             return "Symbol";
+        case LVAL_STR:
+            return "String";
         case LVAL_SEXPR:
             return "S-Expression";
         case LVAL_QEXPR:
@@ -303,7 +887,10 @@ lenv* lenv_new(void) {
 
 void lenv_del(lenv* e) {
     for (int i = 0; i < e->count; i++) {
-        free(e->symbols[i]);
+        if (!image_contains(e->symbols[i])) {
+            free(e->symbols[i]);
+        }
+
         lval_del(e->values[i]);
     }
 
@@ -312,6 +899,13 @@ void lenv_del(lenv* e) {
     free(e);
 }
 
+// Copy a value into the environment, sharing it through the hash-consing
+// table when that is enabled.
+
+lval* lenv_store(lval* v) {
+    return hashcons.enabled ? lval_intern(v) : lval_copy(v);
+}
+
 lval* lenv_get(lenv* e, lval* k) {
     for (int i = 0; i < e->count; i++) {
         if (strcmp(e->symbols[i], k->symbol) == 0) {
@@ -328,7 +922,7 @@ void lenv_put(lenv* e, lval* k, lval* v) {
     for (int i = 0; i < e->count; i++) {
         if (strcmp(e->symbols[i], k->symbol) == 0) {
             lval_del(e->values[i]);
-            e->values[i] = lval_copy(v);
+            e->values[i] = lenv_store(v);
             return;
         }
     }
@@ -341,7 +935,7 @@ void lenv_put(lenv* e, lval* k, lval* v) {
 
     // Copy the contents of lval and symbol string into new location.
 
-    e->values[e->count - 1] = lval_copy(v);
+    e->values[e->count - 1] = lenv_store(v);
     e->symbols[e->count - 1] = malloc(strlen(k->symbol) + 1);
     strcpy(e->symbols[e->count - 1], k->symbol);
 }
@@ -421,12 +1015,327 @@ lval* builtin_join(lenv* e, lval* a) {
     return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM);
+// Keep only the items from start up to (but not including) end, working on the
+// cell array directly rather than popping items one at a time.
+
+lval* lval_slice(lval* v, int start, int end) {
+    for (int i = 0; i < start; i++) {
+        lval_del(v->cell[i]);
     }
 
-    lval* x = lval_pop(a, 0);
+    for (int i = end; i < v->count; i++) {
+        lval_del(v->cell[i]);
+    }
+
+    memmove(&v->cell[0], &v->cell[start], sizeof(lval*) * (end - start));
+    v->count = end - start;
+    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+
+    return v;
+}
+
+lval* builtin_len(lenv* e, lval* a) {
+    LASSERT_NUM("len", a, 1);
+    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+    lval* x = lval_num(a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("nth", a, 1, LVAL_NUM);
+
+    long i = a->cell[1]->number;
+
+    LASSERT(a, i >= 0 && i < a->cell[0]->count,
+            "Function 'nth' passed index %li out of range for a list of %i items.",
+            i, a->cell[0]->count);
+
+    lval* v = lval_pop(a, 0);
+    lval_del(a);
+    return lval_slice(v, i, i + 1);
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+    LASSERT_NUM("last", a, 1);
+    LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("last", a, 0);
+
+    lval* v = lval_take(a, 0);
+    return lval_slice(v, v->count - 1, v->count);
+}
+
+lval* builtin_slice(lenv* e, lval* a) {
+    LASSERT_NUM("slice", a, 3);
+    LASSERT_TYPE("slice", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+    LASSERT_TYPE("slice", a, 2, LVAL_NUM);
+
+    long start = a->cell[1]->number;
+    long end = a->cell[2]->number;
+
+    LASSERT(a, 0 <= start && start <= end && end <= a->cell[0]->count,
+            "Function 'slice' passed range %li to %li out of range for a list of %i items.",
+            start, end, a->cell[0]->count);
+
+    lval* v = lval_pop(a, 0);
+    lval_del(a);
+    return lval_slice(v, start, end);
+}
+
+// Sorting
+//
+// A list made up only of Numbers is sorted with an LSD radix sort on the
+// numbers, one byte per pass. Anything else is sorted with an introsort
+// (quicksort that falls back to heapsort when it recurses too deeply, and to
+// insertion sort on short ranges) using lval_cmp, which orders values first
+// by type, then by number, by text, or element by element for lists. Both
+// rearrange the cell pointer array of the list in place.
+
+int lval_cmp(lval* x, lval* y) {
+    if (x->type != y->type) {
+        return x->type < y->type ? -1 : 1;
+    }
+
+    switch (x->type) {
+        case LVAL_FUN:
+            return x->function == y->function ? 0 :
+                (size_t) x->function < (size_t) y->function ? -1 : 1;
+        case LVAL_NUM:
+            return x->number == y->number ? 0 : x->number < y->number ? -1 : 1;
+        case LVAL_ERR:
+            return strcmp(x->error, y->error);
+        case LVAL_SYM:
+            return strcmp(x->symbol, y->symbol);
+        case LVAL_STR:
+            return strcmp(x->string, y->string);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < x->count && i < y->count; i++) {
+                int c = lval_cmp(x->cell[i], y->cell[i]);
+
+                if (c != 0) {
+                    return c;
+                }
+            }
+
+            return x->count == y->count ? 0 : x->count < y->count ? -1 : 1;
+    }
+
+    return 0;
+}
+
+void lval_sort_radix(lval** cell, int n) {
+    int passes = sizeof(unsigned long);
+    unsigned long* keys = malloc(sizeof(unsigned long) * n * 2);
+    lval** cells = malloc(sizeof(lval*) * n);
+    int (*counts)[256] = calloc(passes, sizeof(*counts));
+
+    unsigned long* from_keys = keys;
+    unsigned long* to_keys = keys + n;
+    lval** from = cell;
+    lval** to = cells;
+
+    // Flipping the sign bit makes negative numbers sort below positive ones
+    // when the keys are compared as unsigned. The byte counts for every pass
+    // are gathered in the same sweep.
+
+    unsigned long sign = 1UL << (passes * 8 - 1);
+
+    for (int i = 0; i < n; i++) {
+        from_keys[i] = (unsigned long) cell[i]->number ^ sign;
+
+        for (int p = 0; p < passes; p++) {
+            counts[p][(from_keys[i] >> (p * 8)) & 0xff]++;
+        }
+    }
+
+    for (int p = 0; p < passes; p++) {
+        int shift = p * 8;
+
+        // Skip the pass if every key has the same byte here.
+
+        if (counts[p][(from_keys[0] >> shift) & 0xff] == n) {
+            continue;
+        }
+
+        int offset = 0;
+
+        for (int b = 0; b < 256; b++) {
+            int c = counts[p][b];
+            counts[p][b] = offset;
+            offset += c;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int j = counts[p][(from_keys[i] >> shift) & 0xff]++;
+            to_keys[j] = from_keys[i];
+            to[j] = from[i];
+        }
+
+        unsigned long* swap_keys = from_keys;
+        from_keys = to_keys;
+        to_keys = swap_keys;
+
+        lval** swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != cell) {
+        memcpy(cell, from, sizeof(lval*) * n);
+    }
+
+    free(keys);
+    free(cells);
+    free(counts);
+}
+
+void lval_sort_insertion(lval** cell, int lo, int hi) {
+    for (int i = lo + 1; i < hi; i++) {
+        lval* x = cell[i];
+        int j = i;
+
+        while (j > lo && lval_cmp(cell[j - 1], x) > 0) {
+            cell[j] = cell[j - 1];
+            j--;
+        }
+
+        cell[j] = x;
+    }
+}
+
+void lval_sort_sift(lval** cell, int lo, int root, int n) {
+    lval* x = cell[lo + root];
+
+    while (root * 2 + 1 < n) {
+        int child = root * 2 + 1;
+
+        if (child + 1 < n && lval_cmp(cell[lo + child], cell[lo + child + 1]) < 0) {
+            child++;
+        }
+
+        if (lval_cmp(x, cell[lo + child]) >= 0) {
+            break;
+        }
+
+        cell[lo + root] = cell[lo + child];
+        root = child;
+    }
+
+    cell[lo + root] = x;
+}
+
+void lval_sort_heap(lval** cell, int lo, int hi) {
+    int n = hi - lo;
+
+    for (int i = n / 2 - 1; i >= 0; i--) {
+        lval_sort_sift(cell, lo, i, n);
+    }
+
+    for (int i = n - 1; i > 0; i--) {
+        lval* x = cell[lo];
+        cell[lo] = cell[lo + i];
+        cell[lo + i] = x;
+        lval_sort_sift(cell, lo, 0, i);
+    }
+}
+
+void lval_sort_intro(lval** cell, int lo, int hi, int depth) {
+    while (hi - lo > 16) {
+        if (depth-- == 0) {
+            lval_sort_heap(cell, lo, hi);
+            return;
+        }
+
+        // Use the median of the first, middle and last items as the pivot.
+
+        int mid = lo + (hi - lo) / 2;
+        lval* a = cell[lo];
+        lval* b = cell[mid];
+        lval* c = cell[hi - 1];
+
+        lval* pivot = lval_cmp(a, b) < 0
+            ? (lval_cmp(b, c) < 0 ? b : lval_cmp(a, c) < 0 ? c : a)
+            : (lval_cmp(a, c) < 0 ? a : lval_cmp(b, c) < 0 ? c : b);
+
+        int i = lo;
+        int j = hi - 1;
+
+        while (i <= j) {
+            while (lval_cmp(cell[i], pivot) < 0) {
+                i++;
+            }
+
+            while (lval_cmp(cell[j], pivot) > 0) {
+                j--;
+            }
+
+            if (i <= j) {
+                lval* x = cell[i];
+                cell[i] = cell[j];
+                cell[j] = x;
+                i++;
+                j--;
+            }
+        }
+
+        // Recurse into the smaller half and loop on the larger one.
+
+        if (j + 1 - lo < hi - i) {
+            lval_sort_intro(cell, lo, j + 1, depth);
+            lo = i;
+        } else {
+            lval_sort_intro(cell, i, hi, depth);
+            hi = j + 1;
+        }
+    }
+
+    lval_sort_insertion(cell, lo, hi);
+}
+
+lval* lval_sort(lval* v) {
+    int numbers = 1;
+
+    for (int i = 0; i < v->count && numbers; i++) {
+        numbers = v->cell[i]->type == LVAL_NUM;
+    }
+
+    if (v->count < 2) {
+        return v;
+    }
+
+    if (numbers) {
+        lval_sort_radix(v->cell, v->count);
+    } else {
+        int depth = 0;
+
+        for (int n = v->count; n > 1; n >>= 1) {
+            depth += 2;
+        }
+
+        lval_sort_intro(v->cell, 0, v->count, depth);
+    }
+
+    return v;
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+    LASSERT_NUM("sort", a, 1);
+    LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+
+    return lval_sort(lval_take(a, 0));
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE(op, a, i, LVAL_NUM);
+    }
+
+    lval* x = lval_pop(a, 0);
 
     if ((strcmp(op, "-") == 0) && (a->count == 0)) {
         x->number = -x->number;
@@ -506,195 +1415,2129 @@ lval* builtin_def(lenv* e, lval* a) {
     return lval_sexpr();
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
-}
+// Memoization
+//
+// `memo f a b ...` calls the builtin f with the arguments a b ... and caches
+// the result under the whole evaluated call, so a repeated call with
+// structurally equal arguments returns a copy of the cached result instead of
+// running f again. Only use it with calls whose result depends on nothing but
+// their arguments; for example, `memo eval {...}` does not notice later
+// changes to the variables the expression refers to.
+//
+// The cache is a chained hash table keyed by lval_hash and checked with
+// lval_eq. Entries are also kept on a doubly linked list in order of use, and
+// the least recently used entry is dropped once MEMO_CAPACITY is exceeded.
+
+#define MEMO_CAPACITY 4096
+#define MEMO_BUCKETS 8192
+
+typedef struct memo_entry {
+    unsigned long hash;
+    lval* call;
+    lval* result;
+
+    struct memo_entry* next;
+    struct memo_entry* newer;
+    struct memo_entry* older;
+} memo_entry;
+
+struct {
+    memo_entry* buckets[MEMO_BUCKETS];
+    memo_entry* newest;
+    memo_entry* oldest;
 
-void lenv_add_builtins(lenv* e) {
-    // Variable Functions
+    int count;
+    long hits;
+    long misses;
+} memo;
 
-    lenv_add_builtin(e, "def", builtin_def);
+void memo_unlink(memo_entry* m) {
+    if (m->newer) {
+        m->newer->older = m->older;
+    } else {
+        memo.newest = m->older;
+    }
 
-    // List Functions
+    if (m->older) {
+        m->older->newer = m->newer;
+    } else {
+        memo.oldest = m->newer;
+    }
+}
 
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+void memo_push(memo_entry* m) {
+    m->newer = NULL;
+    m->older = memo.newest;
 
-    // Mathematical Functions
+    if (memo.newest) {
+        memo.newest->newer = m;
+    } else {
+        memo.oldest = m;
+    }
 
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    memo.newest = m;
 }
 
-// Evaluation
+memo_entry* memo_find(lval* call, unsigned long hash) {
+    memo_entry* m = memo.buckets[hash % MEMO_BUCKETS];
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    // Evaluate the children.
+    while (m) {
+        if (m->hash == hash && lval_eq(m->call, call)) {
+            return m;
+        }
 
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+        m = m->next;
     }
 
-    // Perform error checking.
+    return NULL;
+}
 
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
-        }
+void memo_evict(void) {
+    memo_entry* m = memo.oldest;
+    memo_entry** slot = &memo.buckets[m->hash % MEMO_BUCKETS];
+
+    // Unhook the entry from its bucket chain, then from the use list.
+
+    while (*slot != m) {
+        slot = &(*slot)->next;
     }
 
-    if (v->count == 0) {
-        return v;
-    } else if (v->count == 1) {
-        return lval_take(v, 0);
+    *slot = m->next;
+    memo_unlink(m);
+
+    lval_del(m->call);
+    lval_del(m->result);
+    free(m);
+    memo.count--;
+}
+
+void memo_insert(lval* call, unsigned long hash, lval* result) {
+    memo_entry* m = malloc(sizeof(memo_entry));
+    m->hash = hash;
+    m->call = call;
+    m->result = result;
+
+    m->next = memo.buckets[hash % MEMO_BUCKETS];
+    memo.buckets[hash % MEMO_BUCKETS] = m;
+    memo_push(m);
+    memo.count++;
+
+    if (memo.count > MEMO_CAPACITY) {
+        memo_evict();
     }
+}
 
-    // Ensure the first element is a function after evaluation.
+lval* builtin_memo(lenv* e, lval* a) {
+    LASSERT(a, a->count >= 1,
+            "Function 'memo' passed incorrect number of arguments. Got %i, Expected at least %i.",
+            a->count, 1);
+    LASSERT_TYPE("memo", a, 0, LVAL_FUN);
 
-    lval* f = lval_pop(v, 0);
+    unsigned long hash = lval_hash(a);
+    memo_entry* m = memo_find(a, hash);
 
-    if (f->type != LVAL_FUN) {
-        lval* error = lval_err(
-                "S-Expression starts with incorrect type. Got %s, expected %s.",
-                ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f);
-        lval_del(v);
-        return error;
+    if (m) {
+        memo.hits++;
+
+        // Move the entry to the front of the use list.
+
+        memo_unlink(m);
+        memo_push(m);
+
+        lval_del(a);
+        return lval_copy(m->result);
     }
 
-    // Call built-in with operator.
+    memo.misses++;
 
-    lval* result = f->function(e, v);
+    lval* call = lval_copy(a);
+    lval* f = lval_pop(a, 0);
+    lval* result = f->function(e, a);
     lval_del(f);
-    return result;
-}
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
-    } else if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
+    // Errors are not cached, so that a failed call is retried next time.
+
+    if (result->type == LVAL_ERR) {
+        lval_del(call);
     } else {
-        return v;
+        memo_insert(call, hash, lval_copy(result));
     }
+
+    return result;
 }
 
-// Reading
+// An S-Expression with a single element evaluates to that element rather than
+// calling it, so `memo-stats` is called with an empty Q-Expression: `memo-stats {}`.
+// It returns {hits misses entries}.
 
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    if (errno != ERANGE) {
-        return lval_num(x);
-    } else {
-        return lval_err("Invalid number.");
-    }
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    LASSERT_NUM("memo-stats", a, 1);
+    LASSERT_TYPE("memo-stats", a, 0, LVAL_QEXPR);
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_num(memo.hits));
+    x = lval_add(x, lval_num(memo.misses));
+    x = lval_add(x, lval_num(memo.count));
+
+    lval_del(a);
+    return x;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-    // If Symbol or Number, return the conversion to that type.
+// Hash-Consing Functions
 
-    if (strstr(t->tag, "number")) {
-        return lval_read_num(t);
-    } else if (strstr(t->tag, "symbol")) {
-        return lval_sym(t->contents);
-    }
+lval* builtin_hashcons(lenv* e, lval* a) {
+    LASSERT_NUM("hashcons", a, 1);
+    LASSERT_TYPE("hashcons", a, 0, LVAL_NUM);
 
-    // If a root, S-expression, or Q-expression, then create an empty list.
+    hashcons.enabled = a->cell[0]->number != 0;
 
-    lval* x = NULL;
+    lval_del(a);
+    return lval_sexpr();
+}
 
-    if (strcmp(t->tag, ">") == 0) {
-        x = lval_sexpr();
-    } else if (strstr(t->tag, "sexpr")) {
-        x = lval_sexpr();
-    } else if (strstr(t->tag, "qexpr")) {
-        x = lval_qexpr();
-    }
+// `hashcons-stats {}` returns {nodes unique}: the number of nodes the shared
+// values in the environment would take up as separate copies, and the number
+// of distinct nodes actually held in the table. Their ratio is the dedup ratio.
 
-    // Then fill this list with any valid expression contained within.
+lval* builtin_hashcons_stats(lenv* e, lval* a) {
+    LASSERT_NUM("hashcons-stats", a, 1);
+    LASSERT_TYPE("hashcons-stats", a, 0, LVAL_QEXPR);
 
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) {
-            continue;
-        } else if (strcmp(t->children[i]->contents, ")") == 0) {
-            continue;
-        } else if (strcmp(t->children[i]->contents, "{") == 0) {
-            continue;
-        } else if (strcmp(t->children[i]->contents, "}") == 0) {
-            continue;
-        } else if (strcmp(t->children[i]->tag, "regex") == 0) {
-            continue;
-        }
+    long nodes = 0;
 
-        x = lval_add(x, lval_read(t->children[i]));
+    for (int i = 0; i < e->count; i++) {
+        if (e->values[i]->refs) {
+            nodes += lval_size(e->values[i]);
+        }
     }
 
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_num(nodes));
+    x = lval_add(x, lval_num(hashcons.count));
+
+    lval_del(a);
     return x;
 }
 
-// Main
+// Source File Functions
 
-int main(int argc, char** argv) {
-    // Create some parsers and define them with the following language.
-    mpc_parser_t* Number = mpc_new("number");
-    mpc_parser_t* Symbol = mpc_new("symbol");
-    mpc_parser_t* Sexpr = mpc_new("sexpr");
-    mpc_parser_t* Qexpr = mpc_new("qexpr");
-    mpc_parser_t* Expr = mpc_new("expr");
-    mpc_parser_t* Lispy = mpc_new("lispy");
-    mpca_lang(MPCA_LANG_DEFAULT,
-            "                                                  \
-            number   : /-?[0-9]+/ ;                            \
-            symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;      \
-            sexpr    : '(' <expr>* ')' ;                       \
-            qexpr    : '{' <expr>* '}' ;                       \
-            expr     : <number> | <symbol> | <sexpr> | <qexpr> ;        \
-            lispy    : /^/ <expr>* /$/ ;                       \
-            ", Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+lval* lispy_load(lenv* e, const char* filename);
 
-    puts("byo-lisp Version 0.0.11");
-    puts("Author: Nicholas P. Cole");
-    puts("Press Ctrl-C to exit.");
+// `load "file"` evaluates each expression in the file in turn, printing any
+// errors as it goes.
 
-    lenv* e = lenv_new();
-    lenv_add_builtins(e);
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-    while (1) {
-        char* input = readline("byo-lisp> ");
-        add_history(input);
+    lval* x = lispy_load(e, a->cell[0]->string);
+    lval_del(a);
+    return x;
+}
 
-        mpc_result_t r;
-        
-        if (mpc_parse("<stdin>", input, Lispy, &r)) {
-            lval* x = lval_eval(e, lval_read(r.output));
-            lval_println(x);
-            lval_del(x);
-            mpc_ast_delete(r.output);
-        } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
-        }
+// Image Functions
 
-        free(input);
+lval* lenv_save_image(lenv* e, const char* filename);
+
+// `save-image "file"` writes the environment to an image that a later run can
+// start from with --image=file.
+
+lval* builtin_save_image(lenv* e, lval* a) {
+    LASSERT_NUM("save-image", a, 1);
+    LASSERT_TYPE("save-image", a, 0, LVAL_STR);
+
+    lval* x = lenv_save_image(e, a->cell[0]->string);
+    lval_del(a);
+    return x;
+}
+
+// Serialization Functions
+
+lval* lval_serialize_file(lval* v, const char* filename);
+lval* lval_deserialize_file(const char* filename);
+
+// `serialize "file" v` writes v to the file in the binary format described
+// under Binary Serialization, and `deserialize "file"` reads it back.
+
+lval* builtin_serialize(lenv* e, lval* a) {
+    LASSERT_NUM("serialize", a, 2);
+    LASSERT_TYPE("serialize", a, 0, LVAL_STR);
+
+    lval* x = lval_serialize_file(a->cell[1], a->cell[0]->string);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_deserialize(lenv* e, lval* a) {
+    LASSERT_NUM("deserialize", a, 1);
+    LASSERT_TYPE("deserialize", a, 0, LVAL_STR);
+
+    lval* x = lval_deserialize_file(a->cell[0]->string);
+    lval_del(a);
+    return x;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(func);
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+// Every builtin, with its index in this table as its id. Images refer to
+// builtins by id, so add new ones at the end to keep older images loadable.
+// An image saved by a build with more builtins than this one is rejected.
+
+typedef struct {
+    char* name;
+    lbuiltin func;
+} lbuiltin_entry;
+
+lbuiltin_entry lbuiltins[] = {
+    // Variable Functions
+
+    { "def", builtin_def },
+
+    // List Functions
+
+    { "list", builtin_list },
+    { "head", builtin_head },
+    { "tail", builtin_tail },
+    { "eval", builtin_eval },
+    { "join", builtin_join },
+    { "len", builtin_len },
+    { "nth", builtin_nth },
+    { "last", builtin_last },
+    { "slice", builtin_slice },
+    { "sort", builtin_sort },
+
+    // Mathematical Functions
+
+    { "+", builtin_add },
+    { "-", builtin_sub },
+    { "*", builtin_mul },
+    { "/", builtin_div },
+
+    // Memoization Functions
+
+    { "memo", builtin_memo },
+    { "memo-stats", builtin_memo_stats },
+
+    // Hash-Consing Functions
+
+    { "hashcons", builtin_hashcons },
+    { "hashcons-stats", builtin_hashcons_stats },
+
+    // Source File Functions
+
+    { "load", builtin_load },
+
+    // Image Functions
+
+    { "save-image", builtin_save_image },
+
+    // Serialization Functions
+
+    { "serialize", builtin_serialize },
+    { "deserialize", builtin_deserialize },
+
+    { NULL, NULL }
+};
+
+void lenv_add_builtins(lenv* e) {
+    for (int i = 0; lbuiltins[i].name; i++) {
+        lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+    }
+}
+
+int lbuiltin_id(lbuiltin func) {
+    for (int i = 0; lbuiltins[i].name; i++) {
+        if (lbuiltins[i].func == func) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Heap Images
+//
+// An image is the environment written out as a header followed by four flat
+// arrays: the environment entries, every lval reachable from them, the cell
+// arrays of the lists, and the text of the names, symbols and strings. Nodes
+// refer to text and cells by their offset in those arrays, cells and entries
+// refer to nodes by index, and functions are stored by builtin id, so the
+// file does not depend on where it is loaded.
+//
+// Loading maps the file copy-on-write and turns the offsets back into pointers
+// in one linear pass over the nodes and cells, with no parsing and no
+// allocation per value. The environment then points straight into the
+// mapping; lval_del and lenv_del leave anything inside it alone, and lenv_get
+// still hands out private copies, so the mapped nodes are never changed.
+
+#define IMAGE_MAGIC "LISPYIMG"
+#define IMAGE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    int version;
+
+    // The image can only be used by a build with the same lval layout and
+    // the same builtins.
+
+    int lval_size;
+    int builtins_num;
+
+    int entries_num;
+    long nodes_num;
+    long cells_num;
+    long text_size;
+} image_header;
+
+typedef struct {
+    size_t symbol;
+    size_t value;
+} image_entry;
+
+struct {
+    char* base;
+    size_t size;
+} image;
+
+int image_contains(void* p) {
+    return image.base != NULL && (char*) p >= image.base && (char*) p < image.base + image.size;
+}
+
+int lbuiltins_num(void) {
+    int n = 0;
+
+    while (lbuiltins[n].name) {
+        n++;
+    }
+
+    return n;
+}
+
+typedef struct {
+    lval* nodes;
+    lval** sources;
+    long nodes_num;
+    long nodes_capacity;
+
+    size_t* cells;
+    long cells_num;
+    long cells_capacity;
+
+    lbuf text;
+} image_writer;
+
+// Give v the next node slot, to be filled in when the writer reaches it.
+
+size_t image_push(image_writer* w, lval* v) {
+    if (w->nodes_num == w->nodes_capacity) {
+        w->nodes_capacity *= 2;
+        w->nodes = realloc(w->nodes, sizeof(lval) * w->nodes_capacity);
+        w->sources = realloc(w->sources, sizeof(lval*) * w->nodes_capacity);
+    }
+
+    w->sources[w->nodes_num] = v;
+    return w->nodes_num++;
+}
+
+size_t image_text(image_writer* w, char* s) {
+    size_t offset = w->text.length;
+    lbuf_write(&w->text, s, strlen(s) + 1);
+    return offset;
+}
+
+lval* lenv_save_image(lenv* e, const char* filename) {
+    image_writer w = { 0 };
+    w.nodes_capacity = 256;
+    w.nodes = malloc(sizeof(lval) * w.nodes_capacity);
+    w.sources = malloc(sizeof(lval*) * w.nodes_capacity);
+    w.cells_capacity = 256;
+    w.cells = malloc(sizeof(size_t) * w.cells_capacity);
+
+    image_entry* entries = malloc(sizeof(image_entry) * (e->count + 1));
+
+    for (int i = 0; i < e->count; i++) {
+        entries[i].symbol = image_text(&w, e->symbols[i]);
+        entries[i].value = image_push(&w, e->values[i]);
+    }
+
+    // Lay the nodes out breadth first. The node array doubles as the queue:
+    // when the writer reaches a list, its items are pushed on the end, so
+    // nesting depth never touches the C stack.
+
+    for (long i = 0; i < w.nodes_num; i++) {
+        lval* v = w.sources[i];
+        lval x;
+
+        // Clear the padding too, so that saving the same environment always
+        // gives the same file.
+
+        memset(&x, 0, sizeof(lval));
+        x.type = v->type;
+
+        switch (v->type) {
+            case LVAL_NUM:
+                x.number = v->number;
+                break;
+            case LVAL_FUN:
+                x.number = lbuiltin_id(v->function);
+                break;
+            case LVAL_ERR:
+                x.error = (char*) image_text(&w, v->error);
+                break;
+            case LVAL_SYM:
+                x.symbol = (char*) image_text(&w, v->symbol);
+                break;
+            case LVAL_STR:
+                x.string = (char*) image_text(&w, v->string);
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                x.count = v->count;
+                x.cell = (lval**) (size_t) w.cells_num;
+
+                while (w.cells_num + v->count > w.cells_capacity) {
+                    w.cells_capacity *= 2;
+                    w.cells = realloc(w.cells, sizeof(size_t) * w.cells_capacity);
+                }
+
+                for (int j = 0; j < v->count; j++) {
+                    w.cells[w.cells_num++] = image_push(&w, v->cell[j]);
+                }
+
+                break;
+        }
+
+        w.nodes[i] = x;
+    }
+
+    image_header h;
+    memset(&h, 0, sizeof(image_header));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.lval_size = sizeof(lval);
+    h.builtins_num = lbuiltins_num();
+    h.entries_num = e->count;
+    h.nodes_num = w.nodes_num;
+    h.cells_num = w.cells_num;
+    h.text_size = w.text.length;
+
+    FILE* f = fopen(filename, "wb");
+    int failed = f == NULL;
+
+    if (f) {
+        fwrite(&h, sizeof(image_header), 1, f);
+        fwrite(entries, sizeof(image_entry), e->count, f);
+        fwrite(w.nodes, sizeof(lval), w.nodes_num, f);
+        fwrite(w.cells, sizeof(size_t), w.cells_num, f);
+        fwrite(w.text.data, 1, w.text.length, f);
+        failed = ferror(f);
+        failed = fclose(f) != 0 || failed;
+    }
+
+    free(entries);
+    free(w.nodes);
+    free(w.sources);
+    free(w.cells);
+    free(w.text.data);
+
+    if (failed) {
+        return lval_err("Could not write image '%s'.", filename);
+    }
+
+    return lval_sexpr();
+}
+
+void image_unmap(char* base, size_t size) {
+#ifdef _WIN32
+    free(base);
+#else
+    munmap(base, size);
+#endif
+}
+
+// Map a whole file into memory, or return NULL.
+
+char* image_map(const char* filename, size_t* size) {
+#ifdef _WIN32
+    // Without mmap, read the whole file into memory instead.
+
+    FILE* f = fopen(filename, "rb");
+
+    if (f == NULL) {
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* base = malloc(*size + 1);
+
+    if (fread(base, 1, *size, f) != *size) {
+        free(base);
+        base = NULL;
+    }
+
+    fclose(f);
+    return base;
+#else
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    char* base = NULL;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+        if (base == MAP_FAILED) {
+            base = NULL;
+        }
+    }
+
+    close(fd);
+    return base;
+#endif
+}
+
+// Turn a text offset stored in a string field back into a pointer, or return
+// NULL if it is out of range.
+
+char* image_string(image_header* h, char* text, char* offset) {
+    return (size_t) offset < (size_t) h->text_size ? text + (size_t) offset : NULL;
+}
+
+// Turn the offsets and indexes in a mapped image back into pointers, checking
+// that each one stays inside its array. Returns 0 if the image is damaged.
+
+int image_relocate(char* base, size_t size) {
+    image_header* h = (image_header*) base;
+
+    if (size < sizeof(image_header) || memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version != IMAGE_VERSION || h->lval_size != (int) sizeof(lval) ||
+            h->builtins_num < 0 || h->builtins_num > lbuiltins_num() ||
+            h->entries_num < 0 || h->nodes_num < 0 ||
+            h->cells_num < 0 || h->text_size < 0) {
+        return 0;
+    }
+
+    image_entry* entries = (image_entry*) (base + sizeof(image_header));
+    lval* nodes = (lval*) (entries + h->entries_num);
+    lval** cells = (lval**) (nodes + h->nodes_num);
+    char* text = (char*) (cells + h->cells_num);
+
+    if ((size_t) (text - base) + h->text_size != size ||
+            (h->text_size > 0 && text[h->text_size - 1] != '\0')) {
+        return 0;
+    }
+
+    for (long i = 0; i < h->nodes_num; i++) {
+        lval* v = &nodes[i];
+        v->refs = 0;
+
+        switch (v->type) {
+            case LVAL_NUM:
+                break;
+            case LVAL_FUN:
+                if (v->number < 0 || v->number >= h->builtins_num) {
+                    return 0;
+                }
+
+                v->function = lbuiltins[v->number].func;
+                break;
+            case LVAL_ERR:
+                if ((v->error = image_string(h, text, v->error)) == NULL) {
+                    return 0;
+                }
+                break;
+            case LVAL_SYM:
+                if ((v->symbol = image_string(h, text, v->symbol)) == NULL) {
+                    return 0;
+                }
+                break;
+            case LVAL_STR:
+                if ((v->string = image_string(h, text, v->string)) == NULL) {
+                    return 0;
+                }
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                if (v->count < 0 || (size_t) v->cell + v->count > (size_t) h->cells_num) {
+                    return 0;
+                }
+
+                v->cell = cells + (size_t) v->cell;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    for (long i = 0; i < h->cells_num; i++) {
+        size_t index;
+        memcpy(&index, &cells[i], sizeof(size_t));
+
+        if (index >= (size_t) h->nodes_num) {
+            return 0;
+        }
+
+        cells[i] = &nodes[index];
+    }
+
+    for (int i = 0; i < h->entries_num; i++) {
+        if (entries[i].symbol >= (size_t) h->text_size ||
+                entries[i].value >= (size_t) h->nodes_num) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Load an image into an empty environment.
+
+lval* lenv_load_image(lenv* e, const char* filename) {
+    size_t size;
+    char* base = image_map(filename, &size);
+
+    if (base == NULL) {
+        return lval_err("Could not open image '%s'.", filename);
+    }
+
+    if (!image_relocate(base, size)) {
+        image_unmap(base, size);
+        return lval_err("'%s' is not an image for this version of byo-lisp.", filename);
+    }
+
+    image.base = base;
+    image.size = size;
+
+    image_header* h = (image_header*) base;
+    image_entry* entries = (image_entry*) (base + sizeof(image_header));
+    lval* nodes = (lval*) (entries + h->entries_num);
+    char* text = (char*) ((lval**) (nodes + h->nodes_num) + h->cells_num);
+
+    e->count = h->entries_num;
+    e->symbols = malloc(sizeof(char*) * e->count);
+    e->values = malloc(sizeof(lval*) * e->count);
+
+    for (int i = 0; i < e->count; i++) {
+        e->symbols[i] = text + entries[i].symbol;
+        e->values[i] = &nodes[entries[i].value];
+    }
+
+    // Builtins added since the image was saved are bound as well, unless the
+    // image already defines something under the same name.
+
+    for (int i = h->builtins_num; lbuiltins[i].name; i++) {
+        int defined = 0;
+
+        for (int j = 0; j < h->entries_num; j++) {
+            if (strcmp(e->symbols[j], lbuiltins[i].name) == 0) {
+                defined = 1;
+                break;
+            }
+        }
+
+        if (!defined) {
+            lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+        }
+    }
+
+    return lval_sexpr();
+}
+
+void image_close(void) {
+    if (image.base) {
+        image_unmap(image.base, image.size);
+        image.base = NULL;
+    }
+}
+
+// Binary Serialization
+//
+// lval_serialize appends a compact binary encoding of a value to a buffer, and
+// lval_deserialize reads one back. The encoding is:
+//
+//     'L' 'B' version
+//     nodes, depth, symbols             (varints)
+//     symbols times: length, bytes      (the symbol table)
+//     the nodes in prefix order, each a tag byte followed by
+//         Number                        zigzag varint
+//         Symbol                        varint index into the symbol table
+//         String, Error                 varint length, bytes
+//         Function                      varint builtin id
+//         S-Expression, Q-Expression    varint count, then the items
+//
+// Varints are little-endian base 128, so small numbers take a single byte, and
+// zigzag encoding keeps small negative numbers small too. Each distinct symbol
+// name is written once. The size of everything the decoder allocates comes
+// before it: the depth sizes its stack, and each string and cell array is
+// allocated at its final size, so decoding never reallocates.
+//
+// The tag bytes are fixed here rather than taken from the LVAL_ values, so
+// that reordering the types cannot change the meaning of data already written.
+// They keep the values the first version of the format used.
+
+#define LSER_VERSION 1
+
+enum { LSER_ERR = 0, LSER_NUM = 1, LSER_SYM = 2, LSER_STR = 3, LSER_FUN = 4, LSER_SEXPR = 5, LSER_QEXPR = 6 };
+
+int lser_tag(int type) {
+    switch (type) {
+        case LVAL_ERR: return LSER_ERR;
+        case LVAL_NUM: return LSER_NUM;
+        case LVAL_SYM: return LSER_SYM;
+        case LVAL_STR: return LSER_STR;
+        case LVAL_FUN: return LSER_FUN;
+        case LVAL_SEXPR: return LSER_SEXPR;
+        case LVAL_QEXPR: return LSER_QEXPR;
+    }
+
+    return -1;
+}
+
+// The type a tag stands for, or -1 if it is not a tag.
+
+int lser_type(int tag) {
+    switch (tag) {
+        case LSER_ERR: return LVAL_ERR;
+        case LSER_NUM: return LVAL_NUM;
+        case LSER_SYM: return LVAL_SYM;
+        case LSER_STR: return LVAL_STR;
+        case LSER_FUN: return LVAL_FUN;
+        case LSER_SEXPR: return LVAL_SEXPR;
+        case LSER_QEXPR: return LVAL_QEXPR;
+    }
+
+    return -1;
+}
+
+void lbuf_put_varint(lbuf* b, unsigned long x) {
+    lbuf_reserve(b, 10);
+
+    while (x >= 0x80) {
+        b->data[b->length++] = (char) (x | 0x80);
+        x >>= 7;
+    }
+
+    b->data[b->length++] = (char) x;
+}
+
+void lbuf_put_text(lbuf* b, char* s) {
+    int n = strlen(s);
+    lbuf_put_varint(b, n);
+    lbuf_write(b, s, n);
+}
+
+// Symbol names seen so far, with an open addressing table from name to index.
+
+typedef struct {
+    char** names;
+    int count;
+    int size;
+    int* slots;
+} lser_symbols;
+
+unsigned long lser_hash(char* s) {
+    unsigned long h = 2166136261UL;
+
+    for (char* c = s; *c; c++) {
+        h = h * 16777619UL ^ (unsigned char) *c;
+    }
+
+    return h;
+}
+
+int lser_symbol(lser_symbols* t, char* name) {
+    if ((t->count + 1) * 2 > t->size) {
+        int size = t->size ? t->size * 2 : 64;
+        int* slots = malloc(sizeof(int) * size);
+
+        for (int i = 0; i < size; i++) {
+            slots[i] = -1;
+        }
+
+        for (int i = 0; i < t->count; i++) {
+            int j = lser_hash(t->names[i]) & (size - 1);
+
+            while (slots[j] >= 0) {
+                j = (j + 1) & (size - 1);
+            }
+
+            slots[j] = i;
+        }
+
+        free(t->slots);
+        t->slots = slots;
+        t->size = size;
+        t->names = realloc(t->names, sizeof(char*) * size / 2);
+    }
+
+    int i = lser_hash(name) & (t->size - 1);
+
+    while (t->slots[i] >= 0) {
+        if (strcmp(t->names[t->slots[i]], name) == 0) {
+            return t->slots[i];
+        }
+
+        i = (i + 1) & (t->size - 1);
+    }
+
+    t->names[t->count] = name;
+    t->slots[i] = t->count;
+    return t->count++;
+}
+
+void lval_serialize(lbuf* b, lval* v) {
+    // The nodes are written to a separate buffer first, since the node count,
+    // depth and symbol table that go in front of them are only known at the
+    // end. Lists are walked with an explicit stack, as when printing.
+
+    lbuf body = { NULL, 0, 0, NULL };
+    lser_symbols symbols = { NULL, 0, 0, NULL };
+    long nodes = 0;
+
+    int slots = 32;
+    int depth = 0;
+    int max_depth = 0;
+    lbuf_frame* stack = malloc(sizeof(lbuf_frame) * slots);
+
+    while (1) {
+        nodes++;
+        lbuf_putc(&body, (char) lser_tag(v->type));
+
+        switch (v->type) {
+            case LVAL_NUM:
+                lbuf_put_varint(&body, ((unsigned long) v->number << 1) ^
+                        (unsigned long) (v->number < 0 ? -1L : 0L));
+                break;
+            case LVAL_SYM:
+                lbuf_put_varint(&body, lser_symbol(&symbols, v->symbol));
+                break;
+            case LVAL_STR:
+                lbuf_put_text(&body, v->string);
+                break;
+            case LVAL_ERR:
+                lbuf_put_text(&body, v->error);
+                break;
+            case LVAL_FUN:
+                lbuf_put_varint(&body, lbuiltin_id(v->function));
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                lbuf_put_varint(&body, v->count);
+                break;
+        }
+
+        if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->count > 0) {
+            if (depth == slots) {
+                slots *= 2;
+                stack = realloc(stack, sizeof(lbuf_frame) * slots);
+            }
+
+            stack[depth].list = v;
+            stack[depth].i = 0;
+            depth++;
+
+            if (depth > max_depth) {
+                max_depth = depth;
+            }
+
+            v = v->cell[0];
+            continue;
+        }
+
+        // Move on to the next item, leaving every list that has run out.
+
+        while (depth > 0) {
+            lbuf_frame* f = &stack[depth - 1];
+
+            if (++f->i < f->list->count) {
+                v = f->list->cell[f->i];
+                break;
+            }
+
+            depth--;
+        }
+
+        if (depth == 0) {
+            break;
+        }
+    }
+
+    lbuf_putc(b, 'L');
+    lbuf_putc(b, 'B');
+    lbuf_putc(b, LSER_VERSION);
+    lbuf_put_varint(b, nodes);
+    lbuf_put_varint(b, max_depth);
+    lbuf_put_varint(b, symbols.count);
+
+    for (int i = 0; i < symbols.count; i++) {
+        lbuf_put_text(b, symbols.names[i]);
+    }
+
+    lbuf_write(b, body.data, body.length);
+
+    free(stack);
+    free(symbols.names);
+    free(symbols.slots);
+    free(body.data);
+}
+
+typedef struct {
+    const unsigned char* at;
+    const unsigned char* end;
+    int failed;
+} lser_reader;
+
+unsigned long lser_varint(lser_reader* r) {
+    unsigned long x = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->at == r->end) {
+            break;
+        }
+
+        unsigned char c = *r->at++;
+        x |= (unsigned long) (c & 0x7f) << shift;
+
+        if ((c & 0x80) == 0) {
+            return x;
+        }
+    }
+
+    r->failed = 1;
+    return 0;
+}
+
+// Read a length-prefixed run of bytes, returning where it starts.
+
+const char* lser_text(lser_reader* r, unsigned long* length) {
+    *length = lser_varint(r);
+
+    if (r->failed || *length > (unsigned long) (r->end - r->at)) {
+        r->failed = 1;
+        return NULL;
+    }
+
+    const char* s = (const char*) r->at;
+    r->at += *length;
+    return s;
+}
+
+char* lser_copy(const char* s, unsigned long length) {
+    char* x = malloc(length + 1);
+    memcpy(x, s, length);
+    x[length] = '\0';
+    return x;
+}
+
+// A list being read, and how many items it still expects.
+
+typedef struct {
+    lval* list;
+    long remaining;
+} lser_frame;
+
+lval* lval_deserialize(const char* data, long size) {
+    lser_reader r = { (const unsigned char*) data, (const unsigned char*) data + size, 0 };
+
+    if (size < 3 || data[0] != 'L' || data[1] != 'B' || data[2] != LSER_VERSION) {
+        return lval_err("Invalid serialized data.");
+    }
+
+    r.at += 3;
+
+    // Every node and symbol takes at least one byte, which bounds the counts
+    // before anything is allocated from them.
+
+    unsigned long nodes = lser_varint(&r);
+    unsigned long depth = lser_varint(&r);
+    unsigned long symbols_num = lser_varint(&r);
+    unsigned long left = r.end - r.at;
+
+    if (r.failed || nodes > left || depth > nodes || symbols_num > left) {
+        return lval_err("Invalid serialized data.");
+    }
+
+    // The symbol table is left in place; symbols are copied out of it.
+
+    const char** symbols = malloc(sizeof(char*) * (symbols_num + 1));
+    unsigned long* lengths = malloc(sizeof(unsigned long) * (symbols_num + 1));
+
+    for (unsigned long i = 0; i < symbols_num && !r.failed; i++) {
+        symbols[i] = lser_text(&r, &lengths[i]);
+    }
+
+    lser_frame* stack = malloc(sizeof(lser_frame) * (depth + 1));
+    unsigned long stack_num = 0;
+    unsigned long read = 0;
+    lval* root = NULL;
+
+    while (!r.failed) {
+        if (read == nodes || r.at == r.end) {
+            r.failed = 1;
+            break;
+        }
+
+        read++;
+
+        int type = lser_type(*r.at++);
+        unsigned long n;
+        const char* s;
+
+        lval* x = malloc(sizeof(lval));
+        x->type = type;
+        x->refs = 0;
+        x->count = 0;
+        x->cell = NULL;
+
+        switch (type) {
+            case LVAL_NUM:
+                n = lser_varint(&r);
+                x->number = (long) (n >> 1) ^ -(long) (n & 1);
+                break;
+            case LVAL_SYM:
+                n = lser_varint(&r);
+
+                if (n >= symbols_num) {
+                    r.failed = 1;
+                    n = 0;
+                }
+
+                x->symbol = r.failed ? lser_copy("", 0) : lser_copy(symbols[n], lengths[n]);
+                break;
+            case LVAL_STR:
+                s = lser_text(&r, &n);
+                x->string = r.failed ? lser_copy("", 0) : lser_copy(s, n);
+                break;
+            case LVAL_ERR:
+                s = lser_text(&r, &n);
+                x->error = r.failed ? lser_copy("", 0) : lser_copy(s, n);
+                break;
+            case LVAL_FUN:
+                n = lser_varint(&r);
+
+                if (n >= (unsigned long) lbuiltins_num()) {
+                    r.failed = 1;
+                    n = 0;
+                }
+
+                x->function = lbuiltins[n].func;
+                break;
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                n = lser_varint(&r);
+
+                // A list cannot hold more items than there are nodes left.
+
+                if (n > nodes - read) {
+                    r.failed = 1;
+                    n = 0;
+                }
+
+                x->cell = n ? malloc(sizeof(lval*) * n) : NULL;
+                break;
+            default:
+                // Give the node a harmless type so it can still be deleted.
+
+                x->type = LVAL_NUM;
+                r.failed = 1;
+                n = 0;
+                break;
+        }
+
+        if (stack_num == 0) {
+            root = x;
+        } else {
+            lser_frame* f = &stack[stack_num - 1];
+            f->list->cell[f->list->count++] = x;
+            f->remaining--;
+        }
+
+        if ((x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) && n > 0) {
+            if (stack_num == depth) {
+                r.failed = 1;
+                break;
+            }
+
+            stack[stack_num].list = x;
+            stack[stack_num].remaining = n;
+            stack_num++;
+            continue;
+        }
+
+        while (stack_num > 0 && stack[stack_num - 1].remaining == 0) {
+            stack_num--;
+        }
+
+        if (stack_num == 0) {
+            break;
+        }
+    }
+
+    free(symbols);
+    free(lengths);
+    free(stack);
+
+    if (r.failed || read != nodes || r.at != r.end) {
+        if (root) {
+            lval_del(root);
+        }
+
+        return lval_err("Invalid serialized data.");
+    }
+
+    return root;
+}
+
+lval* lval_serialize_file(lval* v, const char* filename) {
+    lbuf b = { NULL, 0, 0, NULL };
+    lval_serialize(&b, v);
+
+    FILE* f = fopen(filename, "wb");
+    int failed = f == NULL;
+
+    if (f) {
+        fwrite(b.data, 1, b.length, f);
+        failed = ferror(f);
+        failed = fclose(f) != 0 || failed;
+    }
+
+    free(b.data);
+
+    if (failed) {
+        return lval_err("Could not write file '%s'.", filename);
+    }
+
+    return lval_sexpr();
+}
+
+lval* lval_deserialize_file(const char* filename) {
+    size_t size;
+    char* data = image_map(filename, &size);
+
+    if (data == NULL) {
+        return lval_err("Could not open file '%s'.", filename);
+    }
+
+    lval* x = lval_deserialize(data, size);
+    image_unmap(data, size);
+    return x;
+}
+
+// Evaluation
+
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    // Evaluate the children.
+
+    for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+
+    // Perform error checking.
+
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LVAL_ERR) {
+            return lval_take(v, i);
+        }
+    }
+
+    if (v->count == 0) {
+        return v;
+    } else if (v->count == 1) {
+        return lval_take(v, 0);
+    }
+
+    // Ensure the first element is a function after evaluation.
+
+    lval* f = lval_pop(v, 0);
+
+    if (f->type != LVAL_FUN) {
+        lval* error = lval_err(
+                "S-Expression starts with incorrect type. Got %s, expected %s.",
+                ltype_name(f->type), ltype_name(LVAL_FUN));
+        lval_del(f);
+        lval_del(v);
+        return error;
+    }
+
+    // Call built-in with operator.
+
+    lval* result = f->function(e, v);
+    lval_del(f);
+    return result;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    } else if (v->type == LVAL_SEXPR) {
+        return lval_eval_sexpr(e, v);
+    } else {
+        return v;
+    }
+}
+
+// Reading
+
+lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    if (errno != ERANGE) {
+        return lval_num(x);
+    } else {
+        return lval_err("Invalid number.");
+    }
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+    // Copy the contents without the surrounding quotes, then unescape them.
+
+    int length = strlen(t->contents) - 2;
+    char* unescaped = malloc(length + 1);
+    memcpy(unescaped, t->contents + 1, length);
+    unescaped[length] = '\0';
+    unescaped = mpcf_unescape(unescaped);
+
+    lval* x = lval_str(unescaped);
+    free(unescaped);
+    return x;
+}
+
+// Rule ids that mpca_lang gives the AST nodes; these follow the order the
+// parsers are passed to it in lispy_grammar_new.
+
+enum {
+    LISPY_NUMBER = 1, LISPY_SYMBOL, LISPY_STRING, LISPY_SEXPR, LISPY_QEXPR, LISPY_EXPR,
+    LISPY_LISPY
+};
+
+lval* lval_read(mpc_ast_t* t) {
+    // If Symbol, Number or String, return the conversion to that type. Otherwise this
+    // is a root, S-expression, or Q-expression, so create an empty list.
+
+    lval* x = NULL;
+
+    switch (t->id) {
+        case LISPY_NUMBER:
+            return lval_read_num(t);
+        case LISPY_SYMBOL:
+            return lval_sym(t->contents);
+        case LISPY_STRING:
+            return lval_read_str(t);
+        case LISPY_QEXPR:
+            x = lval_qexpr();
+            break;
+        default:
+            x = lval_sexpr();
+            break;
+    }
+
+    // Then fill this list with any valid expression contained within. Brackets
+    // and the start and end of input anchors are leaves that no rule claims,
+    // and have negative ids.
+
+    for (int i = 0; i < t->children_num; i++) {
+        if (t->children[i]->id < 0) {
+            continue;
+        }
+
+        x = lval_add(x, lval_read(t->children[i]));
+    }
+
+    return x;
+}
+
+// Direct Reading
+//
+// lval_read_direct reads the same grammar as the mpc parser built by
+// lispy_grammar_new, but turns the text straight into lvals in a single pass,
+// without building an AST first. Like lval_read on the root of a parse, it
+// returns an S-Expression of all the expressions in the input, or an Error
+// describing where the input stopped making sense. Lists are kept on an
+// explicit stack rather than by recursion, so deeply nested input cannot
+// overflow the C stack.
+
+int lval_read_is_space(char c) {
+    return c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v';
+}
+
+int lval_read_is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+int lval_read_is_symbol(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || lval_read_is_digit(c) ||
+        (c != '\0' && strchr("_+-*/\\=<>!&", c) != NULL);
+}
+
+lval* lval_read_error(const char* filename, const char* start, const char* at,
+        char* expected) {
+    int row = 1;
+    int col = 1;
+
+    for (const char* c = start; c < at; c++) {
+        if (*c == '\n') {
+            row++;
+            col = 1;
+        } else {
+            col++;
+        }
+    }
+
+    if (*at == '\0') {
+        return lval_err("%s:%i:%i: error: expected %s at end of input",
+                filename, row, col, expected);
+    } else {
+        return lval_err("%s:%i:%i: error: expected %s at '%c'",
+                filename, row, col, expected, *at);
+    }
+}
+
+lval* lval_read_direct(const char* filename, const char* input) {
+    const char* c = input;
+
+    // The bottom of the stack is the root S-Expression; each open bracket
+    // pushes the list it starts.
+
+    int depth = 0;
+    int slots = 16;
+    lval** stack = malloc(sizeof(lval*) * slots);
+    stack[0] = lval_sexpr();
+
+    while (1) {
+        while (lval_read_is_space(*c)) {
+            c++;
+        }
+
+        if (*c == '\0') {
+            break;
+        }
+
+        lval* x = NULL;
+
+        if (lval_read_is_digit(*c) || (*c == '-' && lval_read_is_digit(c[1]))) {
+            // Accumulate the number as a negative value, which has the larger
+            // range, checking for overflow before each step.
+
+            int negative = *c == '-';
+            long n = 0;
+            int overflow = 0;
+
+            if (negative) {
+                c++;
+            }
+
+            while (lval_read_is_digit(*c)) {
+                int d = *c - '0';
+
+                if (n < (LONG_MIN + d) / 10) {
+                    overflow = 1;
+                } else {
+                    n = n * 10 - d;
+                }
+
+                c++;
+            }
+
+            if (!negative && n == LONG_MIN) {
+                overflow = 1;
+            }
+
+            x = overflow ? lval_err("Invalid number.") : lval_num(negative ? n : -n);
+        } else if (lval_read_is_symbol(*c)) {
+            const char* start = c;
+
+            while (lval_read_is_symbol(*c)) {
+                c++;
+            }
+
+            x = malloc(sizeof(lval));
+            x->type = LVAL_SYM;
+            x->refs = 0;
+            x->symbol = malloc(c - start + 1);
+            memcpy(x->symbol, start, c - start);
+            x->symbol[c - start] = '\0';
+        } else if (*c == '"') {
+            // Find the closing quote, stepping over escaped characters, and
+            // unescape the contents the same way the mpc reader does.
+
+            const char* start = ++c;
+
+            while (*c != '"' && *c != '\0') {
+                c += c[0] == '\\' && c[1] != '\0' ? 2 : 1;
+            }
+
+            if (*c == '\0') {
+                lval* result = lval_read_error(filename, input, c, "'\"'");
+
+                while (depth >= 0) {
+                    lval_del(stack[depth--]);
+                }
+
+                free(stack);
+                return result;
+            }
+
+            char* unescaped = malloc(c - start + 1);
+            memcpy(unescaped, start, c - start);
+            unescaped[c - start] = '\0';
+            unescaped = mpcf_unescape(unescaped);
+
+            x = lval_str(unescaped);
+            free(unescaped);
+            c++;
+        } else if (*c == '(' || *c == '{') {
+            if (depth + 1 == slots) {
+                slots *= 2;
+                stack = realloc(stack, sizeof(lval*) * slots);
+            }
+
+            stack[++depth] = *c == '(' ? lval_sexpr() : lval_qexpr();
+            c++;
+            continue;
+        } else if ((*c == ')' && depth > 0 && stack[depth]->type == LVAL_SEXPR) ||
+                (*c == '}' && depth > 0 && stack[depth]->type == LVAL_QEXPR)) {
+            x = stack[depth--];
+            c++;
+        } else {
+            break;
+        }
+
+        stack[depth] = lval_add(stack[depth], x);
     }
 
-    lenv_del(e);
+    // Anything other than the end of input with every list closed is an error.
+
+    lval* result = stack[0];
+
+    if (*c != '\0' || depth > 0) {
+        char* expected = depth == 0
+            ? "number, symbol, string, '(' or '{'"
+            : stack[depth]->type == LVAL_SEXPR
+                ? "number, symbol, string, '(', '{' or ')'"
+                : "number, symbol, string, '(', '{' or '}'";
+
+        result = lval_read_error(filename, input, c, expected);
+
+        while (depth >= 0) {
+            lval_del(stack[depth--]);
+        }
+    }
+
+    free(stack);
+    return result;
+}
+
+// Parsers for the mpc reader, built once by lispy_grammar_new.
+
+mpc_parser_t* Number;
+mpc_parser_t* Symbol;
+mpc_parser_t* String;
+mpc_parser_t* Sexpr;
+mpc_parser_t* Qexpr;
+mpc_parser_t* Expr;
+mpc_parser_t* Lispy;
+
+// Which reader lispy_read uses; chosen with --reader=direct or --reader=mpc.
+
+int read_direct = 0;
+
+// Read some input into an S-Expression of the expressions it contains, or an
+// Error if it cannot be parsed.
+
+lval* lispy_read(const char* filename, const char* input) {
+    if (read_direct) {
+        return lval_read_direct(filename, input);
+    }
+
+    mpc_result_t r;
+    lval* x;
+
+    if (mpc_parse(filename, input, Lispy, &r)) {
+        x = lval_read(r.output);
+        mpc_ast_delete(r.output);
+    } else {
+        char* message = mpc_err_string(r.error);
+
+        // Drop the trailing newline; lval_println adds its own.
+
+        message[strlen(message) - 1] = '\0';
+        x = lval_err("%s", message);
+        free(message);
+        mpc_err_delete(r.error);
+    }
+
+    return x;
+}
+
+// Streaming Source Reading
+//
+// A source file is read in large blocks, and each top-level expression is
+// read and evaluated as soon as it is complete, so memory use depends on the
+// largest expression rather than on the size of the file. lscan_form finds
+// where the first complete expression in the buffer ends by keeping track of
+// bracket depth and of whether it is inside a string. It carries on from where
+// it stopped when more input arrives, so each byte is only scanned once.
+
+#define LSCAN_BLOCK 65536
+
+typedef struct {
+    char* buffer;
+    int length;
+    int capacity;
+
+    // Start of the text not yet handed out as a form, and how far the scan
+    // has got past it.
+
+    int start;
+    int scanned;
+
+    // Line and column of start in the file.
+
+    int line;
+    int col;
+
+    // Bracket depth, and whether the scan is inside a string, just after a
+    // backslash in a string, or inside a number or symbol at the top level.
+
+    int depth;
+    int string;
+    int escape;
+    int atom;
+} lscan;
+
+// Move start up to end, keeping its line and column up to date.
+
+void lscan_advance(lscan* s, int end) {
+    for (int i = s->start; i < end; i++) {
+        if (s->buffer[i] == '\n') {
+            s->line++;
+            s->col = 1;
+        } else {
+            s->col++;
+        }
+    }
+
+    s->start = end;
+}
+
+// Return the end of the first complete form after start, or -1 if more input
+// is needed to finish it.
+
+int lscan_form(lscan* s) {
+    while (s->scanned < s->length) {
+        char c = s->buffer[s->scanned];
+
+        if (s->string) {
+            if (s->escape) {
+                s->escape = 0;
+            } else if (c == '\\') {
+                s->escape = 1;
+            } else if (c == '"') {
+                s->string = 0;
+
+                if (s->depth == 0) {
+                    return ++s->scanned;
+                }
+            }
+
+            s->scanned++;
+            continue;
+        }
+
+        // A top-level number or symbol ends at the first character that
+        // cannot be part of it.
+
+        if (s->atom && !lval_read_is_symbol(c)) {
+            s->atom = 0;
+            return s->scanned;
+        }
+
+        // Drop whitespace between forms so it does not pile up in the buffer.
+
+        if (s->depth == 0 && !s->atom && s->scanned == s->start && lval_read_is_space(c)) {
+            lscan_advance(s, s->start + 1);
+        }
+
+        s->scanned++;
+
+        if (c == '"') {
+            s->string = 1;
+        } else if (c == '(' || c == '{') {
+            s->depth++;
+        } else if (c == ')' || c == '}') {
+            // An unmatched closing bracket is handed to the reader on its own,
+            // which reports it.
+
+            if (s->depth > 0) {
+                s->depth--;
+            }
+
+            if (s->depth == 0) {
+                return s->scanned;
+            }
+        } else if (s->depth == 0 && lval_read_is_symbol(c)) {
+            s->atom = 1;
+        }
+    }
+
+    return -1;
+}
+
+// Make room for n more bytes after the text. There is always a spare byte
+// after that too, so the text can be NUL-terminated in place.
+
+void lscan_reserve(lscan* s, int n) {
+    if (s->length + n + 1 > s->capacity) {
+        while (s->length + n + 1 > s->capacity) {
+            s->capacity = s->capacity ? s->capacity * 2 : LSCAN_BLOCK + 1;
+        }
+
+        s->buffer = realloc(s->buffer, s->capacity);
+    }
+}
+
+// Read the next block of the file into the buffer, first moving the unfinished
+// form down to the front. Returns the number of bytes read.
+
+int lscan_fill(lscan* s, FILE* f) {
+    if (s->start > 0) {
+        memmove(s->buffer, s->buffer + s->start, s->length - s->start);
+        s->length -= s->start;
+        s->scanned -= s->start;
+        s->start = 0;
+    }
+
+    lscan_reserve(s, LSCAN_BLOCK);
+
+    int n = fread(s->buffer + s->length, 1, LSCAN_BLOCK, f);
+    s->length += n;
+    return n;
+}
+
+// Read and evaluate the expressions in the form at the start of the scan,
+// printing any errors.
+
+void lispy_load_form(lenv* e, const char* filename, lscan* s, int end) {
+    char* text = s->buffer + s->start;
+    int length = end - s->start;
+
+    char after = text[length];
+    text[length] = '\0';
+    lval* forms = lispy_read(filename, text);
+    text[length] = after;
+
+    if (forms->type == LVAL_ERR) {
+        // The readers count rows and columns from the start of the form, so
+        // move a "file:row:col:" position to where the form is in the file.
+
+        int prefix = strlen(filename);
+        int row;
+        int col;
+        int n;
+
+        if (strncmp(forms->error, filename, prefix) == 0 &&
+                sscanf(forms->error + prefix, ":%i:%i:%n", &row, &col, &n) == 2) {
+            lval* x = lval_err("%s:%i:%i:%s", filename, s->line + row - 1,
+                    row == 1 ? s->col + col - 1 : col, forms->error + prefix + n);
+            lval_del(forms);
+            forms = x;
+        }
+
+        lval_println(forms);
+        lval_del(forms);
+        return;
+    }
+
+    for (int i = 0; i < forms->count; i++) {
+        lval* x = lval_eval(e, forms->cell[i]);
+
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
+        }
+
+        lval_del(x);
+    }
+
+    free(forms->cell);
+    free(forms);
+}
+
+lval* lispy_load(lenv* e, const char* filename) {
+    FILE* f = fopen(filename, "rb");
+
+    if (f == NULL) {
+        return lval_err("Could not open file '%s'.", filename);
+    }
+
+    lscan s = { 0 };
+    s.line = 1;
+    s.col = 1;
+
+    int more = lscan_fill(&s, f) > 0;
+
+    while (1) {
+        int end = lscan_form(&s);
+
+        if (end >= 0) {
+            lispy_load_form(e, filename, &s, end);
+            lscan_advance(&s, end);
+        } else if (more) {
+            more = lscan_fill(&s, f) > 0;
+        } else {
+            // Whatever is left at the end of the file is read as it is, so an
+            // unfinished form is reported by the reader.
+
+            if (s.start < s.length) {
+                lispy_load_form(e, filename, &s, s.length);
+            }
+
+            break;
+        }
+    }
+
+    int failed = ferror(f);
+
+    free(s.buffer);
+    fclose(f);
+
+    if (failed) {
+        return lval_err("Could not read file '%s'.", filename);
+    }
+
+    return lval_sexpr();
+}
+
+// Multi-Line Entries
+//
+// An entry typed at the prompt, or piped into standard input, is read and
+// evaluated as one S-Expression once every bracket and string opened in it
+// has been closed, so an expression can carry on over several lines. Each
+// line is added to an lscan buffer and only the new text is scanned, so a
+// long program pasted in is scanned once in all, and read once when it is
+// complete, rather than read again from the start at every line.
+
+// Add a line to the entry, returning 1 if that completes it.
+
+int lentry_add(lscan* s, const char* line) {
+    int length = strlen(line);
+
+    lscan_reserve(s, length + 1);
+    memcpy(s->buffer + s->length, line, length);
+    s->length += length;
+    s->buffer[s->length++] = '\n';
+
+    while (lscan_form(s) >= 0) {}
+
+    return s->depth == 0 && !s->string;
+}
+
+// Whether there is anything but whitespace in the entry so far.
+
+int lentry_pending(lscan* s) {
+    return s->start < s->length;
+}
+
+// Read, evaluate and print the entry, then empty the buffer for the next one.
+
+void lentry_eval(lenv* e, lscan* s) {
+    s->buffer[s->length] = '\0';
+
+    // A read error evaluates to itself, so it is printed like any other.
+
+    lval* x = lval_eval(e, lispy_read("<stdin>", s->buffer + s->start));
+    lval_println(x);
+    lval_del(x);
+
+    s->length = 0;
+    s->start = 0;
+    s->scanned = 0;
+    s->depth = 0;
+    s->string = 0;
+    s->escape = 0;
+    s->atom = 0;
+}
+
+// Batch Mode
+//
+// When given source files, or when standard input is not a terminal, main
+// runs without the REPL: no banner, prompts or history, and stdout is fully
+// buffered in large blocks rather than written a line at a time. Input piped
+// into standard input keeps the REPL's meaning, with each entry read and
+// evaluated as one S-Expression and its result printed.
+
+#define BATCH_BUFFER (1 << 20)
+
+// Read a line of any length from f without its newline, or return NULL at the
+// end of the input. The caller frees the line.
+
+char* batch_read_line(FILE* f) {
+    int capacity = 256;
+    int length = 0;
+    char* line = malloc(capacity);
+
+    while (fgets(line + length, capacity - length, f) != NULL) {
+        length += strlen(line + length);
+
+        if (length > 0 && line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+            return line;
+        }
+
+        if (length == capacity - 1) {
+            capacity *= 2;
+            line = realloc(line, capacity);
+        }
+    }
+
+    // The last line may not end with a newline.
+
+    if (length > 0) {
+        return line;
+    }
+
+    free(line);
+    return NULL;
+}
+
+void batch_run(lenv* e, char** files, int files_num) {
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER);
+
+    double start = clock_seconds();
+
+    if (files_num > 0) {
+        for (int i = 0; i < files_num; i++) {
+            lval* x = lispy_load(e, files[i]);
+
+            if (x->type == LVAL_ERR) {
+                lval_println(x);
+            }
+
+            lval_del(x);
+        }
+    } else {
+        lscan s = { 0 };
+        char* input;
+
+        while ((input = batch_read_line(stdin)) != NULL) {
+            if (lentry_add(&s, input)) {
+                lentry_eval(e, &s);
+            }
+
+            free(input);
+        }
+
+        // An entry left unfinished at the end of the input is read as it is,
+        // so the reader reports what is missing.
+
+        if (lentry_pending(&s)) {
+            lentry_eval(e, &s);
+        }
+
+        free(s.buffer);
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "Finished in %.3f seconds.\n", clock_seconds() - start);
+}
+
+// Grammar
+//
+// Normally the mpc parsers are built from the grammar below each time the
+// program starts. They can also be compiled ahead of time as a separate build
+// step: run
+//
+//     ./variables --emit-grammar=lispy_grammar.c
+//
+// then build again with -DLISPY_STATIC_GRAMMAR and lispy_grammar.c added to
+// the sources. The parsers are then static data, ready with no construction
+// at startup, and must not be deleted.
+
+#ifdef LISPY_STATIC_GRAMMAR
+extern mpc_parser_t* lispy_grammar[];
+#endif
+
+void lispy_grammar_new(void) {
+#ifdef LISPY_STATIC_GRAMMAR
+    Number = lispy_grammar[0];
+    Symbol = lispy_grammar[1];
+    String = lispy_grammar[2];
+    Sexpr = lispy_grammar[3];
+    Qexpr = lispy_grammar[4];
+    Expr = lispy_grammar[5];
+    Lispy = lispy_grammar[6];
+#else
+    // Create some parsers and define them with the following language.
+    Number = mpc_new("number");
+    Symbol = mpc_new("symbol");
+    String = mpc_new("string");
+    Sexpr = mpc_new("sexpr");
+    Qexpr = mpc_new("qexpr");
+    Expr = mpc_new("expr");
+    Lispy = mpc_new("lispy");
+    mpca_lang(MPCA_LANG_DEFAULT, LISPY_GRAMMAR,
+            Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+#endif
+}
+
+void lispy_grammar_delete(void) {
+#ifndef LISPY_STATIC_GRAMMAR
+    // Undefine and delete our parsers.
+    mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+#endif
+}
+
+// Write the parsers out as C source for the ahead-of-time build.
+
+int lispy_grammar_emit(const char* filename) {
+    FILE* f = fopen(filename, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "Could not open '%s'.\n", filename);
+        return 0;
+    }
+
+    int ok = mpc_codegen(f, "lispy_grammar", 7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok) {
+        fprintf(stderr, "Could not write the grammar to '%s'.\n", filename);
+    }
+
+    return ok;
+}
+
+// Main
+//
+// Left out when the interpreter is compiled into another program, such as
+// lval_bench.c, which defines LISPY_NO_MAIN.
+
+#ifndef LISPY_NO_MAIN
+
+int main(int argc, char** argv) {
+    // Any arguments that are not options are source files to run in batch
+    // mode in place of the REPL.
+
+    char** files = malloc(sizeof(char*) * argc);
+    int files_num = 0;
+    char* image_file = NULL;
+    char* grammar_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reader=direct") == 0) {
+            read_direct = 1;
+        } else if (strcmp(argv[i], "--reader=mpc") == 0) {
+            read_direct = 0;
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image_file = argv[i] + 8;
+        } else if (strncmp(argv[i], "--emit-grammar=", 15) == 0) {
+            grammar_file = argv[i] + 15;
+        } else if (strncmp(argv[i], "--", 2) != 0) {
+            files[files_num++] = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--reader=mpc|--reader=direct] [--image=file] "
+                    "[--emit-grammar=file] [file ...]\n", argv[0]);
+            free(files);
+            return 1;
+        }
+    }
+
+    lispy_grammar_new();
+
+    if (grammar_file) {
+        int ok = lispy_grammar_emit(grammar_file);
+        free(files);
+        lispy_grammar_delete();
+        return ok ? 0 : 1;
+    }
+
+    // Start from a saved image if there is one, rather than from the builtins.
+
+    lenv* e = lenv_new();
+
+    if (image_file) {
+        lval* x = lenv_load_image(e, image_file);
+
+        if (x->type == LVAL_ERR) {
+            fprintf(stderr, "%s\n", x->error);
+            lval_del(x);
+            lenv_del(e);
+            free(files);
+            lispy_grammar_delete();
+            return 1;
+        }
 
-    // Undefine and delete our parsers. This point is never reached since there
-    // is nothing in the language to escape the read-evaluate-print loop.
-    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+        lval_del(x);
+    } else {
+        lenv_add_builtins(e);
+    }
+
+    if (files_num > 0 || !stdin_is_terminal()) {
+        batch_run(e, files, files_num);
+
+        free(files);
+        lenv_del(e);
+        image_close();
+        lispy_grammar_delete();
+        return 0;
+    }
+
+    free(files);
+
+    puts("byo-lisp Version 0.0.11");
+    puts("Author: Nicholas P. Cole");
+    puts("Press Ctrl-C to exit.");
+
+    lscan s = { 0 };
+
+    while (1) {
+        // Lines that carry on an unfinished entry get a prompt of their own.
+
+        char* input = readline(lentry_pending(&s) ? "      ... " : "byo-lisp> ");
+
+        // Stop at the end of input (Ctrl-D), first reading whatever is left
+        // of an unfinished entry so the reader reports what is missing.
+
+        if (input == NULL) {
+            putchar('\n');
+
+            if (lentry_pending(&s)) {
+                lentry_eval(e, &s);
+            }
+
+            break;
+        }
+
+        add_history(input);
+
+        if (lentry_add(&s, input)) {
+            lentry_eval(e, &s);
+        }
+
+        free(input);
+    }
+
+    free(s.buffer);
+    lenv_del(e);
+    image_close();
+    lispy_grammar_delete();
 
     return 0;
 }
+
+#endif